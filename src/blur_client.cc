@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "blur_client.h"
+
+int blur_client_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        return -ENAMETOOLONG;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -errno;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(sock, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        int err = errno;
+        close(sock);
+        return -err;
+    }
+
+    return sock;
+}
+
+void blur_request_init(struct blur_request* req, uint32_t width, uint32_t height,
+        uint32_t format)
+{
+    memset(req, 0, sizeof *req);
+    req->magic = BLUR_PROTO_MAGIC;
+    req->version = BLUR_PROTO_VERSION;
+    req->format = format;
+    req->width = width;
+    req->height = height;
+    req->stride = width * (format == BLUR_FORMAT_RGB888 ? 3 : 4);
+    req->radius = 19;
+    req->passes = 1;
+    req->sigma = 1.0f;
+    req->lightness = 1.0f;
+    req->saturation = 1.0f;
+}
+
+int blur_client_memfd(const void* pixels, size_t size)
+{
+    int fd = memfd_create("blur-src", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+
+    void* dst = mmap(NULL, size, PROT_WRITE, MAP_SHARED, fd, 0);
+    if (dst == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    memcpy(dst, pixels, size);
+    munmap(dst, size);
+
+    // the daemon maps it read only, sealing keeps the size stable for it
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    return fd;
+}
+
+int blur_client_send(int sock, const struct blur_request* req, int pixels_fd)
+{
+    struct iovec iov = { (void*)req, sizeof *req };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    memset(cbuf, 0, sizeof cbuf);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pixels_fd, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) return -errno;
+    return n == sizeof *req ? 0 : -EPROTO;
+}
+
+int blur_client_recv(int sock, struct blur_response* resp, int* result_fd)
+{
+    struct iovec iov = { resp, sizeof *resp };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+
+    *result_fd = -1;
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) return -errno;
+    if (n == 0) return -ECONNRESET;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(result_fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (n != sizeof *resp || resp->magic != BLUR_PROTO_MAGIC) {
+        if (*result_fd >= 0) close(*result_fd);
+        *result_fd = -1;
+        return -EPROTO;
+    }
+    return 0;
+}
+
+int blur_client_blur(int sock, const struct blur_request* req, int pixels_fd,
+        struct blur_response* resp, int* result_fd)
+{
+    int ret = blur_client_send(sock, req, pixels_fd);
+    if (ret < 0) return ret;
+    return blur_client_recv(sock, resp, result_fd);
+}
@@ -0,0 +1,40 @@
+#ifndef BLUR_CLIENT_H
+#define BLUR_CLIENT_H
+
+/*
+ * small client library for the blur_image daemon, all calls return 0 or a
+ * non-negative value on success and -errno on failure.
+ */
+
+#include <stddef.h>
+#include "blur_protocol.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* connect to the daemon listening at path, returns the socket */
+int blur_client_connect(const char* path);
+
+/* request with the same defaults as the blur_image command line */
+void blur_request_init(struct blur_request* req, uint32_t width, uint32_t height,
+        uint32_t format);
+
+/* copy pixels into a new sealed memfd that can be passed to the daemon */
+int blur_client_memfd(const void* pixels, size_t size);
+
+/* send one request, pixels_fd is not consumed */
+int blur_client_send(int sock, const struct blur_request* req, int pixels_fd);
+
+/* wait for the next response, *result_fd is -1 unless resp->status is 0 */
+int blur_client_recv(int sock, struct blur_response* resp, int* result_fd);
+
+/* send and wait for the response, only for connections without pipelining */
+int blur_client_blur(int sock, const struct blur_request* req, int pixels_fd,
+        struct blur_response* resp, int* result_fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <queue>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "blur_daemon.h"
+
+using namespace std;
+
+#define err_quit(fmt, ...) do { \
+    fprintf(stderr, fmt, ## __VA_ARGS__); \
+    exit(-1); \
+} while (0)
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+struct blur_conn {
+    int fd;
+    mutex wlock;
+
+    blur_conn(int fd): fd(fd) {}
+    ~blur_conn() { close(fd); }
+};
+
+struct blur_job_order {
+    bool operator()(const blur_job& a, const blur_job& b) const {
+        if (a.req.priority != b.req.priority) return a.req.priority < b.req.priority;
+        return a.seq > b.seq;
+    }
+};
+
+static priority_queue<blur_job, vector<blur_job>, blur_job_order> jobs;
+static mutex jobs_lock;
+static condition_variable jobs_cond;
+static char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+static void send_response(blur_conn& conn, const struct blur_response& resp, int fd)
+{
+    struct iovec iov = { (void*)&resp, sizeof resp };
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    memset(cbuf, 0, sizeof cbuf);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof cbuf;
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    lock_guard<mutex> lk(conn.wlock);
+    // a client that went away is not an error of the daemon
+    sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+}
+
+static void serve_connection(shared_ptr<blur_conn> conn)
+{
+    static uint64_t seq = 0;
+
+    for (;;) {
+        struct blur_request req;
+        struct iovec iov = { &req, sizeof req };
+        char cbuf[CMSG_SPACE(sizeof(int))];
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof cbuf;
+
+        ssize_t n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        int fd = -1;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+
+        if (n != sizeof req || req.magic != BLUR_PROTO_MAGIC ||
+                req.version != BLUR_PROTO_VERSION || fd < 0) {
+            struct blur_response resp;
+            memset(&resp, 0, sizeof resp);
+            resp.magic = BLUR_PROTO_MAGIC;
+            resp.status = -EPROTO;
+            resp.id = n >= (ssize_t)offsetof(struct blur_request, priority) ? req.id : 0;
+            send_response(*conn, resp, -1);
+            if (fd >= 0) close(fd);
+            continue;
+        }
+
+        lock_guard<mutex> lk(jobs_lock);
+        jobs.push(blur_job{conn, req, fd, seq++, now_ms()});
+        jobs_cond.notify_one();
+    }
+}
+
+static void accept_connections(int listen_fd)
+{
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            err_quit("accept: %s\n", strerror(errno));
+        }
+
+        thread(serve_connection, make_shared<blur_conn>(fd)).detach();
+    }
+}
+
+static void daemon_quit(int sig)
+{
+    unlink(socket_path);
+    _exit(0);
+}
+
+int blur_daemon_listen(const char* path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        err_quit("socket path too long\n");
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) err_quit("socket: %s\n", strerror(errno));
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(socket_path, path);
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) < 0 ||
+            listen(listen_fd, 64) < 0) {
+        err_quit("%s: %s\n", path, strerror(errno));
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, daemon_quit);
+    signal(SIGTERM, daemon_quit);
+    return listen_fd;
+}
+
+void blur_daemon_start(int listen_fd)
+{
+    thread(accept_connections, listen_fd).detach();
+}
+
+blur_job blur_daemon_next()
+{
+    unique_lock<mutex> lk(jobs_lock);
+    jobs_cond.wait(lk, [] { return !jobs.empty(); });
+    blur_job job = jobs.top();
+    jobs.pop();
+    return job;
+}
+
+void blur_daemon_reply(const blur_job& job, const struct blur_response& resp, int fd)
+{
+    close(job.fd);
+    send_response(*job.conn, resp, fd);
+}
@@ -0,0 +1,38 @@
+#ifndef BLUR_DAEMON_H
+#define BLUR_DAEMON_H
+
+/*
+ * server side of the blur_image daemon (blur_image -D socket, wire protocol
+ * in blur_protocol.h). a thread per connection reads requests into one
+ * queue, the thread owning the GL context takes them by priority and
+ * answers each on the connection it came in on.
+ */
+
+#include <stdint.h>
+#include <memory>
+#include "blur_protocol.h"
+
+struct blur_conn;
+
+struct blur_job {
+    std::shared_ptr<blur_conn> conn;
+    struct blur_request req;
+    int fd; // source pixels, closed by blur_daemon_reply()
+    uint64_t seq;
+    double queued; // ms of CLOCK_MONOTONIC
+};
+
+// bind and listen at path, which is removed again on SIGINT and SIGTERM;
+// quits on failure
+int blur_daemon_listen(const char* path);
+
+// accept connections on a thread of their own
+void blur_daemon_start(int listen_fd);
+
+// wait for the queued request of the highest priority, FIFO within one
+blur_job blur_daemon_next();
+
+// answer with resp and the result fd, -1 for none; closes the source fd
+void blur_daemon_reply(const blur_job& job, const struct blur_response& resp, int fd);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <fcntl.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <assert.h>
 #include <math.h>
@@ -7,39 +8,76 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <libgen.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <linux/dma-buf.h>
 
 #include <iostream>
 #include <algorithm>
 #include <vector>
 #include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <gbm.h>
 #include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <glib.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
+#include "blur_protocol.h"
+#include "blur_daemon.h"
+#include "cpu_blur.h"
+#include "cpu_adjust.h"
+#include "iir_blur.h"
+#ifdef PARALLEL_ENCODE
+#include "encode.h"
+#endif
+
 using namespace std;
 
+// the GPUs of these platforms cannot run the HSL shader, -l, -s and -b are
+// done on the CPU there (cpu_adjust.cc); -DCPU_ADJUST=on forces it elsewhere
+#if defined(__alpha__) || defined(__sw_64__) || defined(__mips__)
+#define CPU_ADJUST
+#endif
+
 #define err_quit(fmt, ...) do { \
     fprintf(stderr, fmt, ## __VA_ARGS__); \
     exit(-1); \
 } while (0)
 
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 static struct context {
     EGLDisplay display;
     EGLContext gl_context;
 
-    EGLSurface surface;
-
-	int fd; // fd of drm device
+	int fd; // fd of drm device, gbm backend only
 
     struct gbm_device *gbm;
-    struct gbm_surface *gbm_surface;
 
     char* img_path;
     int width, height, ncomp;
     unsigned char* img_data;
+    void* img_map; // mapping of an uncompressed input, img_data points into it
+    size_t img_map_size;
 
     GLuint program, programH, programDirect, programSaveBrt,
            programSetBrt, programSetLgt;
@@ -58,8 +96,26 @@ static struct context {
     GLuint lgtFb;
     GLuint lgtTex; // for lightness
     bool lightnessAdjusted;
+    GLuint readFb; // CPU_ADJUST readback of a tex size target
 
     int tex_width, tex_height;
+    GLuint programDownsample;
+    GLuint downsampleFb;
+    GLuint downsampleTex; // source reduced to tex_width x tex_height
+    GLuint programPyramid; // first level of the pyramid, a 1/4 box reduction
+    GLuint pyramidFb;
+    GLuint pyramidTex; // last level, twice tex size, read by the downsample pass
+    int stride; // source row stride in bytes, 0 for tightly packed
+
+    GLuint outFb;
+    GLuint outTex; // full size result, there is no window surface
+
+    GLuint upPbo[2]; // double buffered upload and readback for streaming
+    GLuint downPbo[2];
+
+    // tex rows of the reduced source in fb[1] and of the first vertical blur
+    // pass in fb[0] drawn while a compressed input was still decoding
+    int reduced_rows, vblur_rows;
 } ctx = {
     0,
 };
@@ -72,11 +128,235 @@ static bool adjustHSL = false;
 static GLfloat lightness = 1.0f;
 static GLfloat saturation = 1.0f;
 static GLfloat sigma = 1.0;
+static bool vertexTaps = false;
+static float downscale = 0.25f; // blur passes run at this fraction of the image size
+static float autotuneBound = 0; // -A, minimum PSNR of a tuned plan
+// blur parameters given on the command line, a stored plan leaves them be
+enum { GIVEN_DOWNSCALE = 1, GIVEN_RADIUS = 2, GIVEN_ROUNDS = 4, GIVEN_SIGMA = 8, GIVEN_TAPS = 16 };
+static int givenParams = 0;
+static float gaussSigma = 0; // -G, Gaussian sigma in full size pixels
+static char* profile_path = NULL;
+static char* preview_path = NULL; // -Q, path or fd:N
+static bool zeroCopy = false; // -Z, render into a gbm buffer object
+static float poolCeiling = 0; // -M, MiB of render targets, 0 for no limit
+static char* effect_spec = NULL; // -E
+static int batchSize = 0; // -I, images per atlas
+static char* trace_path = NULL; // -J, Chrome/Perfetto trace of the run
+// -O outputs share the reduced source between chains and still run HSL and
+// brightness as passes of their own
+static bool separatePasses = false;
+
+static bool showStats = false;
+
+// cpu is not EGL, it runs the whole job through iir_blur.cc
+enum { BACKEND_AUTO, BACKEND_GBM, BACKEND_SURFACELESS, BACKEND_DEVICE, BACKEND_CPU,
+    BACKEND_COUNT };
+static const char* backend_names[] = { "auto", "gbm", "surfaceless", "device", "cpu" };
+static int backend = BACKEND_AUTO;
+
+enum { STREAM_NONE, STREAM_RGBA, STREAM_BGRA, STREAM_Y4M };
+static int streamFormat = STREAM_NONE;
 
 // must be odd
 static GLint radius = 19;
-// big enough storage for radius maximum of 49
-static GLfloat kernel[101];
+// big enough storage for radius maximum of 49, sized as the BlurData block
+static GLfloat kernel[104];
+
+/*
+ * -J records spans of every thread and of the GPU and writes them as a
+ * Chrome trace (chrome://tracing, ui.perfetto.dev) when the process exits.
+ * without -J nothing is recorded, trace_now() and trace_span() return before
+ * reading the clock and trace_gpu() before issuing a query. draws are timed
+ * with GL_EXT_disjoint_timer_query timestamps, moved onto CLOCK_MONOTONIC
+ * by the GPU time read next to now_ms() once the context is up.
+ */
+#define TRACE_GPU_TID 0 // pseudo thread the GPU spans go on
+
+struct trace_event {
+    string name;
+    int tid;
+    double start, end; // ms, CLOCK_MONOTONIC
+};
+
+struct trace_mark {
+    const char* name; // of the draw before, NULL starts a sequence
+    GLuint query;
+    double issued; // ms, the draw cannot start on the GPU earlier
+};
+
+static struct trace_state {
+    mutex lock;
+    vector<trace_event> events;
+    vector<pair<int, const char*> > threads;
+    bool gpu; // timer queries available
+    double gpu_offset; // ms from GPU time to now_ms()
+    vector<trace_mark> marks; // one timestamp after every draw
+    double gpu_last; // ms, the last mark collected
+} trace;
+
+static PFNGLQUERYCOUNTEREXTPROC query_counter;
+static PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_ui64;
+
+static int trace_tid()
+{
+    static thread_local int tid = syscall(SYS_gettid);
+    return tid;
+}
+
+static double trace_now()
+{
+    return trace_path ? now_ms() : 0;
+}
+
+// a span on the calling thread from start to now
+static void trace_span(const string& name, double start)
+{
+    if (!trace_path) return;
+    double end = now_ms();
+    lock_guard<mutex> lk(trace.lock);
+    trace.events.push_back(trace_event{name, trace_tid(), start, end});
+}
+
+static void trace_thread(const char* name)
+{
+    if (!trace_path) return;
+    lock_guard<mutex> lk(trace.lock);
+    trace.threads.push_back(make_pair(trace_tid(), name));
+}
+
+// needs the context current, GPU spans stay off without the extension
+static void trace_gpu_init()
+{
+    const char* exts = (const char*)glGetString(GL_EXTENSIONS);
+    if (!exts || !strstr(exts, "GL_EXT_disjoint_timer_query")) {
+        fprintf(stderr, "-J: no GL_EXT_disjoint_timer_query, draws are not traced\n");
+        return;
+    }
+    query_counter = (PFNGLQUERYCOUNTEREXTPROC)eglGetProcAddress("glQueryCounterEXT");
+    get_query_ui64 = (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress(
+            "glGetQueryObjectui64vEXT");
+    if (!query_counter || !get_query_ui64) return;
+
+    // the current GPU time where the implementation can tell it, else the
+    // time of a timestamp the CPU waited for
+    GLint64 gpu = 0;
+    glGetInteger64v(GL_TIMESTAMP_EXT, &gpu);
+    double cpu = now_ms();
+    if (gpu == 0) {
+        GLuint q;
+        glGenQueries(1, &q);
+        query_counter(q, GL_TIMESTAMP_EXT);
+        glFinish();
+        cpu = now_ms();
+        GLuint64 ts = 0;
+        get_query_ui64(q, GL_QUERY_RESULT_EXT, &ts);
+        glDeleteQueries(1, &q);
+        gpu = ts;
+    }
+    GLint disjoint;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint); // clears the flag
+    trace.gpu_offset = cpu - gpu / 1000000.0;
+    trace.gpu = true;
+}
+
+// a timestamp once the GPU is done with the draws issued so far, the draw
+// before it is named
+static void trace_gpu(const char* name)
+{
+    if (!trace.gpu) return;
+    GLuint q;
+    glGenQueries(1, &q);
+    query_counter(q, GL_TIMESTAMP_EXT);
+    trace.marks.push_back(trace_mark{name, q, now_ms()});
+}
+
+// turn the timestamps into GPU spans, wait only says whether to block for
+// results the GPU has not written yet
+static void trace_gpu_collect(bool wait)
+{
+    if (trace.marks.empty()) return;
+
+    // timestamps are written in order, the available ones are a prefix
+    size_t n = 0;
+    for (; n < trace.marks.size(); n++) {
+        GLuint available = 1;
+        if (!wait) {
+            glGetQueryObjectuiv(trace.marks[n].query, GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+        }
+        if (!available) break;
+    }
+    if (n == 0) return;
+
+    GLint disjoint = 0;
+    glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    for (size_t i = 0; i < n; i++) {
+        trace_mark& m = trace.marks[i];
+        GLuint64 ts = 0;
+        get_query_ui64(m.query, GL_QUERY_RESULT_EXT, &ts);
+        glDeleteQueries(1, &m.query);
+        // the GPU may have idled between the last mark and the draw
+        double t = ts / 1000000.0 + trace.gpu_offset;
+        if (m.name && !disjoint) {
+            double start = min(t, max(trace.gpu_last, m.issued));
+            lock_guard<mutex> lk(trace.lock);
+            trace.events.push_back(trace_event{m.name, TRACE_GPU_TID, start, t});
+        }
+        trace.gpu_last = t;
+    }
+    if (disjoint) {
+        fprintf(stderr, "-J: GPU timer disjoint, %zu draw marks dropped\n", n);
+    }
+    trace.marks.erase(trace.marks.begin(), trace.marks.begin() + n);
+}
+
+static void trace_json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        } else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// complete events in microseconds, thread names as metadata
+static void trace_write()
+{
+    FILE* f = fopen(trace_path, "w");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", trace_path, strerror(errno));
+        return;
+    }
+
+    lock_guard<mutex> lk(trace.lock);
+    int pid = getpid();
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"blur_image\"}}", pid, pid);
+    if (trace.gpu) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"GPU\"}}", pid, TRACE_GPU_TID);
+    }
+    for (auto& t: trace.threads) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":", pid, t.first);
+        trace_json_string(f, t.second);
+        fprintf(f, "}}");
+    }
+    for (auto& e: trace.events) {
+        fprintf(f, ",\n{\"name\":");
+        trace_json_string(f, e.name.c_str());
+        fprintf(f, ",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", pid, e.tid,
+                e.start * 1000, (e.end - e.start) * 1000);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    fprintf(stderr, "trace of %zu spans written to %s\n", trace.events.size(), trace_path);
+}
 
 
 /** shaders work on OpenGL ES 3.0 */
@@ -152,6 +432,64 @@ void main() {
 }
 )";
 
+// tap coordinates are computed per vertex so that the fragment stage only
+// does non-dependent texture reads, kernel is linear sampled here
+const GLchar* ts_taps_code = R"(
+#version 300 es
+precision highp float;
+
+const int taps = %d;
+const vec2 dir = vec2(%d.0, %d.0);
+
+in vec2 position;
+in vec2 vTexCoord;
+
+out vec2 texCoord;
+out vec4 tapCoord[taps];
+
+layout (std140) uniform BlurData 
+{
+    highp float kernel[104];
+    highp vec2 resolution;
+};
+
+void main() {
+    gl_Position = vec4(position, 0.0, 1.0);
+    texCoord = vTexCoord;
+    for (int i = 0; i < taps; i++) {
+        vec2 d = dir * kernel[2+i] / resolution;
+        tapCoord[i] = vec4(vTexCoord - d, vTexCoord + d);
+    }
+}
+)";
+
+const GLchar* vs_taps_code = R"(
+#version 300 es
+precision mediump float;
+
+const int taps = %d;
+
+in highp vec2 texCoord;
+in highp vec4 tapCoord[taps];
+
+out vec4 outColor;
+
+layout (std140) uniform BlurData 
+{
+    highp float kernel[104];
+    highp vec2 resolution;
+};
+uniform sampler2D sampler;
+
+void main() {
+    outColor = texture(sampler, texCoord) * kernel[51];
+    for (int i = 0; i < taps; i++) {
+        outColor += texture(sampler, tapCoord[i].xy) * kernel[52+i];
+        outColor += texture(sampler, tapCoord[i].zw) * kernel[52+i];
+    }
+}
+)";
+
 const GLchar* vs_direct = R"(
 #version 300 es
 precision mediump float;
@@ -168,6 +506,45 @@ void main() {
 }
 )";
 
+// direct copy for BGRA streams, swaps red and blue back on output
+const GLchar* vs_direct_swap = R"(
+#version 300 es
+precision mediump float;
+
+in vec3 fragColor;
+in vec2 texCoord;
+
+out vec4 outColor;
+uniform sampler2D sampler;
+
+void main() {
+    outColor = texture(sampler, texCoord.st).bgra;
+}
+)";
+
+// box reduction to the downscale factor: at quarter size each bilinear tap
+// lands between two source texels in both directions and averages a 2x2
+// block, the taps spread with the factor. factors under 1/4 would leave
+// texels out, those reduce through a pyramid (reduced_source())
+const GLchar* vs_downsample = R"(
+#version 300 es
+precision highp float;
+
+in vec3 fragColor;
+in vec2 texCoord;
+
+out vec4 outColor;
+uniform sampler2D sampler;
+
+void main() {
+    vec2 d = %f / vec2(textureSize(sampler, 0));
+    outColor = (texture(sampler, texCoord + vec2(-d.x, -d.y)) +
+            texture(sampler, texCoord + vec2(d.x, -d.y)) +
+            texture(sampler, texCoord + vec2(-d.x, d.y)) +
+            texture(sampler, texCoord + d)) * 0.25;
+}
+)";
+
 const GLchar* vs_save_brightness = R"(
 #version 300 es
 precision mediump float;
@@ -207,7 +584,28 @@ void main() {
 }
 )";
 
-// from http://www.chilliant.com/rgb2hsv.html
+// from http://www.chilliant.com/rgb2hsv.html, shared by vs_set_lightness and
+// the hsl effect
+const GLchar* hsv_code = R"(
+vec3 rgb2hsv(vec3 c)
+{
+    vec4 K = vec4(0.0, -1.0 / 3.0, 2.0 / 3.0, -1.0);
+    vec4 p = mix(vec4(c.bg, K.wz), vec4(c.gb, K.xy), step(c.b, c.g));
+    vec4 q = mix(vec4(p.xyw, c.r), vec4(c.r, p.yzx), step(p.x, c.r));
+
+    float d = q.x - min(q.w, q.y);
+    float e = 1.0e-10;
+    return vec3(abs(q.z + (q.w - q.y) / (6.0 * d + e)), d / (q.x + e), q.x);
+}
+
+vec3 hsv2rgb(vec3 c)
+{
+    vec4 K = vec4(1.0, 2.0 / 3.0, 1.0 / 3.0, 3.0);
+    vec3 p = abs(fract(c.xxx + K.xyz) * 6.0 - K.www);
+    return c.z * mix(K.xxx, clamp(p - K.xxx, 0.0, 1.0), c.y);
+}
+)";
+
 const GLchar* vs_set_lightness = R"(
 #version 300 es
 precision mediump float;
@@ -294,24 +692,7 @@ vec3 RGBtoHSL(vec3 rgb) {
     return vec3(h, s, l);
 }
 
-vec3 rgb2hsv(vec3 c)
-{
-    vec4 K = vec4(0.0, -1.0 / 3.0, 2.0 / 3.0, -1.0);
-    vec4 p = mix(vec4(c.bg, K.wz), vec4(c.gb, K.xy), step(c.b, c.g));
-    vec4 q = mix(vec4(p.xyw, c.r), vec4(c.r, p.yzx), step(p.x, c.r));
-
-    float d = q.x - min(q.w, q.y);
-    float e = 1.0e-10;
-    return vec3(abs(q.z + (q.w - q.y) / (6.0 * d + e)), d / (q.x + e), q.x);
-}
-
-vec3 hsv2rgb(vec3 c)
-{
-    vec4 K = vec4(1.0, 2.0 / 3.0, 1.0 / 3.0, 3.0);
-    vec3 p = abs(fract(c.xxx + K.xyz) * 6.0 - K.www);
-    return c.z * mix(K.xxx, clamp(p - K.xxx, 0.0, 1.0), c.y);
-}
-
+%s
 void main() {
     vec4 clr = texture(sampler, texCoord.st);
     vec3 hsl = rgb2hsv(clr.rgb);
@@ -323,21 +704,14 @@ void main() {
 )";
 
 
+// status is checked by finish_programs(), so the driver can compile in the
+// background until a program is first needed
 static GLuint build_shader(const GLchar* code, GLint type)
 {
     GLuint shader = glCreateShader(type);
     if (shader) {
         glShaderSource(shader, 1, &code, NULL);
         glCompileShader(shader);
-
-        GLint result = GL_TRUE;
-        glGetShaderiv(shader, GL_COMPILE_STATUS, &result);
-
-        if (result == GL_FALSE) {
-            GLchar log[1024];
-            glGetShaderInfoLog(shader, sizeof log - 1, NULL, log);
-            err_quit("error: %s\n", log);
-        }
     }
 
     return shader;
@@ -345,23 +719,55 @@ static GLuint build_shader(const GLchar* code, GLint type)
 
 static char* build_shader_template(const char* shader_tmpl, ...)
 {
-    char* ret = (char*)malloc(strlen(shader_tmpl)+40);
+    va_list va;
+    va_start(va, shader_tmpl);
+    int len = vsnprintf(NULL, 0, shader_tmpl, va);
+    va_end(va);
+
+    char* ret = (char*)malloc(len + 1);
     if (!ret) {
         err_quit("no memory\n");
     }
-    va_list va;
     va_start(va, shader_tmpl);
-    vsprintf(ret, shader_tmpl, va);
+    vsnprintf(ret, len + 1, shader_tmpl, va);
     va_end(va);
     return ret;
 }
 
-static GLuint build_program(int stage)
+// linked but not yet checked by finish_program()
+static vector<GLuint> pending_programs;
+
+static GLuint link_program(const GLchar* ts_src, const GLchar* vs_src)
 {
     GLuint program = glCreateProgram();
+    glAttachShader(program, build_shader(ts_src, GL_VERTEX_SHADER));
+    glAttachShader(program, build_shader(vs_src, GL_FRAGMENT_SHADER));
+    glLinkProgram(program);
+    pending_programs.push_back(program);
+    return program;
+}
+
+// -x and -E downscale=F, under 1/4 the pyramid halves to 1/8 or 1/16
+static float clamp_downscale(float f)
+{
+    f = fmaxf(0.0625f, fminf(1.0f, f));
+    return f < 0.25f ? exp2f(roundf(log2f(f))) : f;
+}
+
+// reduction of the downsample pass, the last halving of a pyramid
+static float pass_factor()
+{
+    return downscale < 0.25f ? 0.5f : downscale;
+}
 
-    GLuint ts = build_shader(ts_code, GL_VERTEX_SHADER);
-    glAttachShader(program, ts);
+static GLuint build_program(int stage)
+{
+    GLchar* ts_src = NULL;
+    switch (stage) {
+        case 7: ts_src = build_shader_template(ts_taps_code, (int)kernel[0]-1, 0, 1); break;
+        case 8: ts_src = build_shader_template(ts_taps_code, (int)kernel[0]-1, 1, 0); break;
+        default: ts_src = strdup(ts_code); break;
+    }
 
     GLchar* vs_src = NULL;
     switch (stage) {
@@ -370,18 +776,39 @@ static GLuint build_program(int stage)
         case 3: vs_src = strdup(vs_direct); break;
         case 4: vs_src = strdup(vs_save_brightness); break;
         case 5: vs_src = strdup(vs_set_brightness); break;
-        case 6: vs_src = build_shader_template(vs_set_lightness, lightness, saturation); break;
+        case 6:
+            vs_src = build_shader_template(vs_set_lightness, lightness, saturation, hsv_code);
+            break;
+        case 7:
+        case 8: vs_src = build_shader_template(vs_taps_code, (int)kernel[0]-1); break;
+        case 9: vs_src = strdup(vs_direct_swap); break;
+        case 10: vs_src = build_shader_template(vs_downsample, 0.25f / pass_factor()); break;
+        case 11: vs_src = build_shader_template(vs_downsample, 1.0f); break;
         default: break;
     } 
-    GLuint vs = build_shader(vs_src, GL_FRAGMENT_SHADER);
+
+    GLuint program = link_program(ts_src, vs_src);
+    free(ts_src);
     free(vs_src);
-    glAttachShader(program, vs);
+    return program;
+}
 
-    glLinkProgram(program);
+static void finish_program(GLuint program)
+{
     GLint result = GL_TRUE;
     glGetProgramiv(program, GL_LINK_STATUS, &result);
     if (result == GL_FALSE) {
         GLchar log[1024];
+        GLuint shaders[2];
+        GLsizei count = 0;
+        glGetAttachedShaders(program, 2, &count, shaders);
+        for (int i = 0; i < count; i++) {
+            glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &result);
+            if (result == GL_FALSE) {
+                glGetShaderInfoLog(shaders[i], sizeof log - 1, NULL, log);
+                err_quit("error: %s\n", log);
+            }
+        }
         glGetProgramInfoLog(program, sizeof log - 1, NULL, log);
         err_quit("error: %s\n", log);
     }
@@ -400,10 +827,8 @@ static GLuint build_program(int stage)
     GLint tex_attrib = glGetAttribLocation(program, "vTexCoord");
     assert(tex_attrib != 0);
     glEnableVertexAttribArray(tex_attrib);
-    glVertexAttribPointer(tex_attrib, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat),
+    glVertexAttribPointer(tex_attrib, 2, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat),
             (const GLvoid*)(5*sizeof(GLfloat)));
-
-    return program;
 }
 
 static void build_gaussian_blur_kernel(GLint* pradius, GLfloat* offset, GLfloat* weight)
@@ -420,7 +845,9 @@ static void build_gaussian_blur_kernel(GLint* pradius, GLfloat* offset, GLfloat*
     }
     sum -= (weight[radius+1] + weight[radius]) * 2.0;
 
-    cerr << "N = " << N << ", sum = " << sum << endl;
+    if (showStats) {
+        cerr << "N = " << N << ", sum = " << sum << endl;
+    }
 
     for (int i = 0; i < radius; i++) {
         offset[i] = (GLfloat)i*sigma;
@@ -443,93 +870,193 @@ static void build_gaussian_blur_kernel(GLint* pradius, GLfloat* offset, GLfloat*
 #endif
 }
 
-static void gl_init()
+// fold each pair of neighbouring taps into one bilinear fetch placed at
+// their weighted center, so the same support needs about half the taps.
+// exact only for taps one texel apart (-S 1), other distances put the fetch
+// between texels the pair does not cover
+static void build_linear_kernel(GLint* pradius, GLfloat* offset, GLfloat* weight)
 {
-    glViewport(0, 0, ctx.width, ctx.height);
-
-    build_gaussian_blur_kernel(&radius, &kernel[1], &kernel[51]);
-    kernel[0] = radius;
-
-    glGenBuffers(1, &ctx.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
-
-    static GLfloat vdata[] = {
-        -1.0f, 1.0f,   1.0f, 0.0f, 0.0f,  0.0f, 1.0f,
-        1.0f, 1.0f,    0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
-        1.0f, -1.0f,   1.0f, 0.0f, 0.0f,  1.0f, 0.0f,
-
-        -1.0f, 1.0f,   1.0f, 0.0f, 0.0f,  0.0f, 1.0f,
-        1.0f, -1.0f,   1.0f, 0.0f, 0.0f,  1.0f, 0.0f,
-        -1.0f, -1.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f
-    };
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vdata), &vdata, GL_STATIC_DRAW);
-
-    glGenTextures(1, &ctx.tex);
-    glBindTexture(GL_TEXTURE_2D, ctx.tex);
-
-    GLenum pixel_fmt = ctx.ncomp == 4 ? GL_RGBA : GL_RGB;
-    glTexImage2D(GL_TEXTURE_2D, 0, pixel_fmt, ctx.width, ctx.height, 0,
-            pixel_fmt, GL_UNSIGNED_BYTE, ctx.img_data);
-    glGenerateMipmap(GL_TEXTURE_2D);
+    GLint taps = *pradius;
+    GLint n = 1;
+    for (int i = 1; i < taps; i += 2) {
+        GLfloat w = weight[i], off = offset[i];
+        if (i+1 < taps) {
+            w += weight[i+1];
+            off = (offset[i] * weight[i] + offset[i+1] * weight[i+1]) / w;
+        }
+        offset[n] = off;
+        weight[n] = w;
+        n++;
+    }
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    *pradius = n;
+}
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+// vertex taps are in use for the current kernel
+static bool kernelTaps = false;
 
-    glGenTextures(2, ctx.fbTex);
-    for (int i = 0; i < 2; i++) {
-        glBindTexture(GL_TEXTURE_2D, ctx.fbTex[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, pixel_fmt, ctx.tex_width, ctx.tex_height,
-                0, pixel_fmt, GL_UNSIGNED_BYTE, NULL);
-        GLenum err;
-        if ((err = glGetError()) != GL_NO_ERROR) {
-            fprintf(stderr, "texture error %x\n", err);
+static void build_kernel()
+{
+    GLint r = radius;
+    build_gaussian_blur_kernel(&r, &kernel[1], &kernel[51]);
+    kernel[0] = r;
+
+    kernelTaps = false;
+    if (vertexTaps) {
+        // center coordinate plus one vec4 per pair of symmetric taps
+        GLint max_varyings = 0, taps = r;
+        glGetIntegerv(GL_MAX_VARYING_VECTORS, &max_varyings);
+        if (sigma != 1.0f) {
+            fprintf(stderr, "-t folds taps one texel apart, -S %g keeps fragment taps\n", sigma);
+        } else if (1 + r / 2 > max_varyings) {
+            fprintf(stderr, "radius %d needs %d varyings (max %d), fall back to fragment taps\n",
+                    r, 1 + r / 2, max_varyings);
+        } else {
+            build_linear_kernel(&taps, &kernel[1], &kernel[51]);
+            kernel[0] = taps;
+            kernelTaps = true;
         }
+    }
+}
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+// programs depend on the kernel size and HSL constants baked into their
+// source, a long running process keeps every variant it has built
+static unordered_map<string, GLuint> program_cache;
 
-        glBindTexture(GL_TEXTURE_2D, 0);
+static GLuint cached_program(int stage)
+{
+    char key[128];
+    snprintf(key, sizeof key, "%d:%d:%f:%f:%f", stage, (int)kernel[0], lightness, saturation,
+            downscale);
+    auto it = program_cache.find(key);
+    if (it != program_cache.end()) {
+        return it->second;
     }
 
-    glGenFramebuffers(2, ctx.fb);
-    for (int i = 0; i < 2; i++) {
-        glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[i]);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx.fbTex[i], 0);
+    GLuint program = build_program(stage);
+    program_cache[key] = program;
+    return program;
+}
 
-        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-            err_quit("framebuffer create failed\n");
-        }
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+#ifndef CPU_ADJUST
+static void build_effects();
+#endif
+
+static void build_programs()
+{
+    ctx.program = cached_program(kernelTaps ? 7 : 1);
+    ctx.programH = cached_program(kernelTaps ? 8 : 2);
+    ctx.programDirect = cached_program(streamFormat == STREAM_BGRA ? 9 : 3);
+    ctx.programDownsample = cached_program(10);
+    if (downscale < 0.25f) {
+        ctx.programPyramid = cached_program(11);
     }
 
-    ctx.program = build_program(1);
-    ctx.programH = build_program(2);
-    ctx.programDirect = build_program(3);
+#ifndef CPU_ADJUST
+    build_effects();
+    if (!separatePasses) {
+        return;
+    }
 
     if (adjustBrightness) {
-        ctx.programSaveBrt = build_program(4);
-        ctx.programSetBrt = build_program(5);
+        ctx.programSaveBrt = cached_program(4);
+        ctx.programSetBrt = cached_program(5);
     }
 
     if (adjustHSL) {
-        ctx.programSetLgt = build_program(6);
+        ctx.programSetLgt = cached_program(6);
     }
+#endif
+}
 
+// wait for the programs built since the last call, attribute pointers are
+// set up against the quad
+static void finish_programs()
+{
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+    for (auto program: pending_programs) {
+        finish_program(program);
+    }
+    pending_programs.clear();
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-static void adjust_brightness(GLuint targetTex)
+// sized formats, images without alpha stay 3 channel on the GPU and
+// drivers need not guess a storage format
+static GLenum internal_format(int ncomp)
+{
+    return ncomp == 4 ? GL_RGBA8 : GL_RGB8;
+}
+
+/*
+ * render targets, a texture and the framebuffer drawing into it, come from a
+ * pool keyed by size and format. released targets wait for the next pass or
+ * image of the same size; those idle for POOL_IDLE_IMAGES images are
+ * deleted, and the oldest idle ones go first when an allocation would pass
+ * the -M ceiling. sizes are estimated at 4 bytes a texel, drivers pad RGB8.
+ */
+#define POOL_IDLE_IMAGES 4
+
+struct render_target {
+    GLuint tex, fb;
+    int width, height;
+    GLenum format; // sized internal format
+    unsigned idle_since; // pool.image when released
+};
+
+static struct target_pool {
+    vector<render_target> used;
+    vector<render_target> idle; // oldest release first
+    size_t ceiling; // bytes, 0 for none
+    size_t bytes, peak; // of all targets, idle or in use
+    unsigned image; // counted by pool_next_image()
+    unsigned created, reused, deleted;
+} pool;
+
+static size_t target_bytes(int w, int h)
+{
+    return (size_t)w * h * 4;
+}
+
+static void delete_target(const render_target& t)
+{
+    glDeleteFramebuffers(1, &t.fb);
+    glDeleteTextures(1, &t.tex);
+    pool.bytes -= target_bytes(t.width, t.height);
+    pool.deleted++;
+}
+
+// false when the target does not fit under the ceiling even with every idle
+// target deleted
+static bool acquire_target(int w, int h, GLenum format, GLuint* tex, GLuint* fb)
 {
-    glGenTextures(1, &ctx.brtTex);
-    glBindTexture(GL_TEXTURE_2D, ctx.brtTex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ctx.tex_width, ctx.tex_height,
-            0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    // the latest released is the likeliest to be resident
+    for (size_t i = pool.idle.size(); i-- > 0; ) {
+        render_target& t = pool.idle[i];
+        if (t.width == w && t.height == h && t.format == format) {
+            pool.used.push_back(t);
+            pool.idle.erase(pool.idle.begin() + i);
+            pool.reused++;
+            *tex = pool.used.back().tex;
+            *fb = pool.used.back().fb;
+            return true;
+        }
+    }
+
+    size_t need = target_bytes(w, h);
+    while (pool.ceiling && pool.bytes + need > pool.ceiling && !pool.idle.empty()) {
+        delete_target(pool.idle.front());
+        pool.idle.erase(pool.idle.begin());
+    }
+    if (pool.ceiling && pool.bytes + need > pool.ceiling) {
+        return false;
+    }
+
+    render_target t = { 0, 0, w, h, format, 0 };
+    glGenTextures(1, &t.tex);
+    glBindTexture(GL_TEXTURE_2D, t.tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format == GL_RGB8 ? GL_RGB : GL_RGBA,
+            GL_UNSIGNED_BYTE, NULL);
     GLenum err;
     if ((err = glGetError()) != GL_NO_ERROR) {
         fprintf(stderr, "texture error %x\n", err);
@@ -539,32 +1066,269 @@ static void adjust_brightness(GLuint targetTex)
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
     glBindTexture(GL_TEXTURE_2D, 0);
 
-    glGenFramebuffers(1, &ctx.brtFb);
-    glBindFramebuffer(GL_FRAMEBUFFER, ctx.brtFb);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx.brtTex, 0);
-
+    glGenFramebuffers(1, &t.fb);
+    glBindFramebuffer(GL_FRAMEBUFFER, t.fb);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t.tex, 0);
     if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-            err_quit("framebuffer create failed\n");
-        }
+        err_quit("framebuffer create failed\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-    // calculate brightness
+    pool.bytes += need;
+    pool.peak = max(pool.peak, pool.bytes);
+    pool.created++;
+    pool.used.push_back(t);
+    *tex = t.tex;
+    *fb = t.fb;
+    return true;
+}
+
+// back into the pool, both ids are cleared
+static void release_target(GLuint* tex, GLuint* fb)
+{
+    for (size_t i = 0; i < pool.used.size(); i++) {
+        if (pool.used[i].tex == *tex) {
+            pool.used[i].idle_since = pool.image;
+            pool.idle.push_back(pool.used[i]);
+            pool.used.erase(pool.used.begin() + i);
+            break;
+        }
+    }
+    *tex = *fb = 0;
+}
+
+// called once per image by the long running modes
+static void pool_next_image()
+{
+    pool.image++;
+    for (size_t i = 0; i < pool.idle.size(); ) {
+        if (pool.image - pool.idle[i].idle_since > POOL_IDLE_IMAGES) {
+            delete_target(pool.idle[i]);
+            pool.idle.erase(pool.idle.begin() + i);
+        } else {
+            i++;
+        }
+    }
+}
+
+static void pool_clear()
+{
+    for (auto& t: pool.used) delete_target(t);
+    for (auto& t: pool.idle) delete_target(t);
+    pool.used.clear();
+    pool.idle.clear();
+}
+
+static void upload_source()
+{
+    glBindTexture(GL_TEXTURE_2D, ctx.tex);
+
+    // describe rows of ctx.stride bytes with the largest alignment that
+    // reproduces them, only padding beyond that needs a row length
+    int row = ctx.width * ctx.ncomp;
+    int stride = ctx.stride ? ctx.stride : row;
+    int align = 8;
+    while (align > 1 && (row + align - 1) / align * align != stride) {
+        align >>= 1;
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, align);
+    if (align == 1 && stride != row) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / ctx.ncomp);
+    }
+
+    GLenum pixel_fmt = ctx.ncomp == 4 ? GL_RGBA : GL_RGB;
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format(ctx.ncomp), ctx.width, ctx.height, 0,
+            pixel_fmt, GL_UNSIGNED_BYTE, ctx.img_data);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+static void free_targets();
+
+// source texture, ping-pong targets and full size output target for
+// the current ctx.width x ctx.height. past the -M ceiling this quits, or
+// returns false with may_fail and nothing allocated
+static bool alloc_targets(bool may_fail = false)
+{
+    glGenTextures(1, &ctx.tex);
+    glBindTexture(GL_TEXTURE_2D, ctx.tex);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // no mipmaps, the downsample pass reads level 0 only
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    if (streamFormat == STREAM_BGRA) {
+        // all passes then see RGBA, vs_direct_swap restores the order
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_R, GL_BLUE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    GLenum format = internal_format(ctx.ncomp);
+    bool ok = acquire_target(ctx.tex_width, ctx.tex_height, format, &ctx.fbTex[0], &ctx.fb[0]) &&
+        acquire_target(ctx.tex_width, ctx.tex_height, format, &ctx.fbTex[1], &ctx.fb[1]) &&
+        acquire_target(ctx.tex_width, ctx.tex_height, format, &ctx.downsampleTex,
+                &ctx.downsampleFb) &&
+        acquire_target(ctx.width, ctx.height, format, &ctx.outTex, &ctx.outFb);
+    if (!ok) {
+        if (!may_fail) {
+            err_quit("render targets of %dx%d exceed the -M ceiling\n", ctx.width, ctx.height);
+        }
+        free_targets();
+    }
+    return ok;
+}
+
+// targets go back to the pool for the next image
+static void free_targets()
+{
+    glDeleteTextures(1, &ctx.tex);
+    ctx.tex = 0;
+    release_target(&ctx.fbTex[0], &ctx.fb[0]);
+    release_target(&ctx.fbTex[1], &ctx.fb[1]);
+    release_target(&ctx.downsampleTex, &ctx.downsampleFb);
+    release_target(&ctx.outTex, &ctx.outFb);
+    release_target(&ctx.pyramidTex, &ctx.pyramidFb);
+
+    // brightness and HSL targets are acquired lazily at the old size
+    release_target(&ctx.brtTex, &ctx.brtFb);
+    release_target(&ctx.lgtTex, &ctx.lgtFb);
+    if (ctx.readFb) {
+        glDeleteFramebuffers(1, &ctx.readFb);
+        ctx.readFb = 0;
+    }
+}
+
+// position, color and texture coordinates of the full target quad
+static const GLfloat vdata[] = {
+    -1.0f, 1.0f,   1.0f, 0.0f, 0.0f,  0.0f, 1.0f,
+    1.0f, 1.0f,    0.0f, 1.0f, 0.0f,  1.0f, 1.0f,
+    1.0f, -1.0f,   1.0f, 0.0f, 0.0f,  1.0f, 0.0f,
+
+    -1.0f, 1.0f,   1.0f, 0.0f, 0.0f,  0.0f, 1.0f,
+    1.0f, -1.0f,   1.0f, 0.0f, 0.0f,  1.0f, 0.0f,
+    -1.0f, -1.0f,  0.0f, 1.0f, 0.0f,  0.0f, 0.0f
+};
+
+// the quad with texture coordinates u0,v0 at its lower left corner and u1,v1
+// at the upper right, -I draws images into parts of an atlas with it
+static void quad_coords(float u0, float v0, float u1, float v1)
+{
+    GLfloat v[sizeof vdata / sizeof vdata[0]];
+    memcpy(v, vdata, sizeof v);
+    for (int i = 0; i < 6; i++) {
+        GLfloat* p = v + i * 7;
+        p[5] = u0 + (p[0] + 1) / 2 * (u1 - u0);
+        p[6] = v0 + (p[1] + 1) / 2 * (v1 - v0);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof v, v);
+}
+
+// kernel, quad and programs, nothing here depends on the image
+static void gl_init_programs()
+{
+    if (glGetString(GL_EXTENSIONS) &&
+            strstr((const char*)glGetString(GL_EXTENSIONS), "GL_KHR_parallel_shader_compile")) {
+        PFNGLMAXSHADERCOMPILERTHREADSKHRPROC max_threads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)
+            eglGetProcAddress("glMaxShaderCompilerThreadsKHR");
+        if (max_threads) max_threads(0xffffffff);
+    }
+
+    build_kernel();
+
+    glGenBuffers(1, &ctx.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vdata), &vdata, GL_STATIC_DRAW);
+
+    build_programs();
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void gl_init()
+{
+    gl_init_programs();
+    if (ctx.width > 0) {
+        alloc_targets();
+        upload_source();
+    }
+    finish_programs();
+}
+
+#ifdef CPU_ADJUST
+static void read_pixels(void* data, int w, int h, int n);
+
+// tex size texture into tightly packed rows of n components
+static void read_texture(GLuint tex, void* data, int n)
+{
+    if (!ctx.readFb) {
+        glGenFramebuffers(1, &ctx.readFb);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.readFb);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+    read_pixels(data, ctx.tex_width, ctx.tex_height, n);
+}
+
+static void write_texture(GLuint tex, const void* data, int n)
+{
+    GLint align = 4;
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &align);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, ctx.tex_width, ctx.tex_height,
+            n == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, align);
+}
+#endif
+
+static void adjust_brightness(GLuint targetTex)
+{
+    // acquired once, streaming mode runs this for every frame
+    if (!ctx.brtFb && !acquire_target(ctx.tex_width, ctx.tex_height, GL_RGBA8,
+                &ctx.brtTex, &ctx.brtFb)) {
+        err_quit("brightness target exceeds the -M ceiling\n");
+    }
+
+#ifdef CPU_ADJUST
+    // one readback gives the mean and the texels to darken
+    vector<unsigned char> data((size_t)ctx.tex_width * ctx.tex_height * 4);
+    read_texture(targetTex, data.data(), 4);
+    int mean = cpu_brightness(data.data(), ctx.tex_width, ctx.tex_height, 4);
+    cerr << "brightness: " << mean << endl;
+    if (mean > 100) {
+        cpu_darken(data.data(), ctx.tex_width, ctx.tex_height, 4);
+        write_texture(ctx.brtTex, data.data(), 4);
+        ctx.brightnessAdjusted = true;
+    }
+    return;
+#endif
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.brtFb);
+
+    // calculate brightness
     glBindTexture(GL_TEXTURE_2D, targetTex);
     glUseProgram(ctx.programSaveBrt);
     glDrawArrays(GL_TRIANGLES, 0, 6);
+    trace_gpu("brightness");
 
     glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    char* data = (char*)malloc(ctx.width * ctx.height * 4);
-    glReadPixels(0, 0, ctx.width, ctx.height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    int count = ctx.tex_width * ctx.tex_height;
+    unsigned int* clr = (unsigned int*)malloc(count * 4);
+    glReadPixels(0, 0, ctx.tex_width, ctx.tex_height, GL_RGBA, GL_UNSIGNED_BYTE, clr);
 
-    int count = ctx.width * ctx.height;
-    int total = 0;
-    unsigned int* clr = (unsigned int *)data;
+    long total = 0;
     for (int i = 0; i < count; i++) {
-        total += (clr[0] >>24) & 0xff;
+        total += (clr[i] >>24) & 0xff;
     }
+    free(clr);
 
     cerr << "brightness: " << total / count << endl;
     if (total / count > 100) {
@@ -572,44 +1336,41 @@ static void adjust_brightness(GLuint targetTex)
         glBindTexture(GL_TEXTURE_2D, targetTex);
         glUseProgram(ctx.programSetBrt);
         glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("darken");
         ctx.brightnessAdjusted = true;
     }
 }
 
 static void adjust_hsl(GLuint targetTex)
 {
-    glGenTextures(1, &ctx.lgtTex);
-    glBindTexture(GL_TEXTURE_2D, ctx.lgtTex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ctx.tex_width, ctx.tex_height,
-            0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    GLenum err;
-    if ((err = glGetError()) != GL_NO_ERROR) {
-        fprintf(stderr, "texture error %x\n", err);
+    if (!ctx.lgtFb && !acquire_target(ctx.tex_width, ctx.tex_height,
+                internal_format(ctx.ncomp), &ctx.lgtTex, &ctx.lgtFb)) {
+        err_quit("HSL target exceeds the -M ceiling\n");
     }
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    glBindTexture(GL_TEXTURE_2D, 0);
+#ifdef CPU_ADJUST
+    // the tex size image is small, reading it back costs less than the
+    // transform on full size pixels would
+    vector<unsigned char> data((size_t)ctx.tex_width * ctx.tex_height * ctx.ncomp);
+    read_texture(targetTex, data.data(), ctx.ncomp);
+    cpu_adjust_hsl(data.data(), ctx.tex_width, ctx.tex_height, ctx.ncomp, lightness, saturation);
+    write_texture(ctx.lgtTex, data.data(), ctx.ncomp);
+    ctx.lightnessAdjusted = true;
+    return;
+#endif
 
-    glGenFramebuffers(1, &ctx.lgtFb);
     glBindFramebuffer(GL_FRAMEBUFFER, ctx.lgtFb);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx.lgtTex, 0);
-
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-        err_quit("framebuffer create failed\n");
-    }
 
     // update brightness
     glBindTexture(GL_TEXTURE_2D, targetTex);
     glUseProgram(ctx.programSetLgt);
     glDrawArrays(GL_TRIANGLES, 0, 6);
+    trace_gpu("hsl");
     ctx.lightnessAdjusted = true;
 }
 
-static void render()
+// upload kernel and resolution into the BlurData block shared by blur programs
+static void setup_ubo()
 {
     GLint validate = GL_TRUE;
     glValidateProgram(ctx.program);
@@ -632,7 +1393,7 @@ static void render()
     glUniformBlockBinding (ctx.programH, blockId, bindingPoint);
 
 
-    glGenBuffers(1, &ctx.ubo);
+    if (!ctx.ubo) glGenBuffers(1, &ctx.ubo);
     glBindBuffer(GL_UNIFORM_BUFFER, ctx.ubo);
     glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, ctx.ubo);
 
@@ -646,8 +1407,11 @@ static void render()
 
     // std140 padding is considered
     int ubo_sz = sizes[0]*strides[0] + sizes[1]*sizeof(GLfloat)*4;
-    cerr << "sizes[0] = " << sizes[0] << ", strides[0] = " << strides[0] << endl;
-    cerr << "total ubo size = " << ubo_sz << endl;
+    // every daemon request, stream frame and tuned plan lands here
+    if (showStats) {
+        cerr << "sizes[0] = " << sizes[0] << ", strides[0] = " << strides[0] << endl;
+        cerr << "total ubo size = " << ubo_sz << endl;
+    }
     GLchar udata[ubo_sz];
     memset(udata, 0, ubo_sz);
 
@@ -658,30 +1422,85 @@ static void render()
     *(GLfloat*)(udata + sizes[0]*strides[0]) = (GLfloat)ctx.tex_width;
     *((GLfloat*)(udata + sizes[0]*strides[0]) + 1) = (GLfloat)ctx.tex_height;
     glBufferData(GL_UNIFORM_BUFFER, ubo_sz, udata, GL_STATIC_DRAW);
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+/*
+ * factors under 1/4 reduce through a pyramid: the source is box reduced to
+ * 1/4 as usual, then halved by 2x2 boxes until twice tex size, and the
+ * downsample pass makes the last halving. the boxes are aligned, so the
+ * chain averages the same 1/downscale square the single pass would, with
+ * no texel left out, and the blur rounds run at the lowest level.
+ */
+// input of the downsample pass for a w x h source in ctx.tex: the source
+// itself or the last level of its pyramid, drawn with the full target quad
+static GLuint reduced_source(int w, int h)
+{
+    if (downscale >= 0.25f) {
+        return ctx.tex;
+    }
 
-    glDisable(GL_DEPTH_TEST);
+    release_target(&ctx.pyramidTex, &ctx.pyramidFb);
+    GLenum format = internal_format(ctx.ncomp);
+    GLuint from = ctx.tex, from_fb = 0;
+    for (float f = 0.25f; f > downscale * 1.5f; f *= 0.5f) {
+        int lw = max(1, (int)(w * f)), lh = max(1, (int)(h * f));
+        if (!acquire_target(lw, lh, format, &ctx.pyramidTex, &ctx.pyramidFb)) {
+            err_quit("pyramid level of %dx%d exceeds the -M ceiling\n", lw, lh);
+        }
+        glViewport(0, 0, lw, lh);
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.pyramidFb);
+        glBindTexture(GL_TEXTURE_2D, from);
+        glUseProgram(from == ctx.tex ? ctx.programPyramid : ctx.programDownsample);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("pyramid");
 
-    glViewport(0, 0, ctx.tex_width, ctx.tex_height);
-    if (adjustHSL) {
-        adjust_hsl(ctx.tex);
+        if (from != ctx.tex) {
+            release_target(&from, &from_fb);
+        }
+        from = ctx.pyramidTex;
+        from_fb = ctx.pyramidFb;
     }
+    return from;
+}
 
-    for (int i = 0; i < rounds; i++) {
-        GLuint tex1 = i == 0 ? (adjustHSL?ctx.lgtTex:ctx.tex) : ctx.fbTex[1];
+// the full size source is read once, every pass after works at tex size
+static void downsample_source()
+{
+    GLuint src = reduced_source(ctx.width, ctx.height);
+    glViewport(0, 0, ctx.tex_width, ctx.tex_height);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.downsampleFb);
+    glBindTexture(GL_TEXTURE_2D, src);
+    glUseProgram(ctx.programDownsample);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    trace_gpu("downsample");
+}
+
+// blur rounds [from, to), the result is left in fbTex[1]
+static void blur_rounds(int from, int to)
+{
+    glViewport(0, 0, ctx.tex_width, ctx.tex_height);
+    for (int i = from; i < to; i++) {
+        GLuint tex1 = i == 0 ? (adjustHSL?ctx.lgtTex:ctx.downsampleTex) : ctx.fbTex[1];
 
         glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[0]);
         glBindTexture(GL_TEXTURE_2D, tex1);
         glUseProgram(ctx.program);
         glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("vertical blur");
 
         glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[1]);
         glBindTexture(GL_TEXTURE_2D, ctx.fbTex[0]);
         glUseProgram(ctx.programH);
         glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("horizontal blur");
     }
+}
 
+// brightness and the final draw of the blur result into outFb at w x h,
+// fbTex[1] is left untouched
+static void draw_output(GLuint outFb, int w, int h)
+{
+    ctx.brightnessAdjusted = false;
     if (adjustBrightness) {
         if (rounds == 0) {
             adjust_brightness(ctx.lgtTex);
@@ -689,194 +1508,3076 @@ static void render()
             adjust_brightness(ctx.fbTex[1]);
     } 
     
-    glViewport(0, 0, ctx.width, ctx.height);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, w, h);
+    glBindFramebuffer(GL_FRAMEBUFFER, outFb);
     if (ctx.brightnessAdjusted)
         glBindTexture(GL_TEXTURE_2D, ctx.brtTex);
     else
         glBindTexture(GL_TEXTURE_2D, rounds == 0 ? ctx.lgtTex: ctx.fbTex[1]);
     glUseProgram(ctx.programDirect);
     glDrawArrays(GL_TRIANGLES, 0, 6);
+    trace_gpu("output");
+}
 
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    char* data = (char*)malloc(ctx.width * ctx.height * 4);
-    glReadPixels(0, 0, ctx.width, ctx.height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+/*
+ * effect chains. stages apply in the order listed, but only downscale, blur
+ * and scale read neighbouring texels and need passes of their own. the
+ * per-pixel stages (hsl, darken, vignette, tint) are appended to the
+ * fragment shader of the pass before them, so a chain costs the downsample,
+ * two passes per blur round and the final draw whatever it holds. stages
+ * ahead of the blur run on the reduced image, for all but hsl that is the
+ * same as running them on the source, and hsl always ran there. without -E
+ * the chain is built from -l, -s and -b.
+ */
+enum { FX_DOWNSCALE, FX_BLUR, FX_SCALE, FX_HSL, FX_DARKEN, FX_VIGNETTE, FX_TINT, FX_COUNT };
+static const char* fx_names[] = { "downscale", "blur", "scale", "hsl", "darken", "vignette",
+    "tint" };
+
+struct effect_stage {
+    int kind;
+    float v[4];
+};
 
-    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_data((const guchar*)data, 
-            GDK_COLORSPACE_RGB, TRUE, 8, ctx.width,
-            ctx.height, ctx.width * 4, NULL, NULL);
+static vector<effect_stage> effects; // -E
 
-    string new_path = string("blurred.") + ctx.img_path;
-    if (outfile) new_path = outfile;
-    cout << "new_path: " << new_path << endl;
-    auto suffix = new_path.substr(new_path.find_last_of('.')+1, new_path.size());
-    if (suffix == "jpg" || suffix.empty()) suffix = "jpeg";
+// -E stage,stage=v:v,... e.g. hsl=0.8:1.2,blur=2,darken,vignette=0.5:0.4,tint=1:0.9:0.8:0.1
+static void parse_effects(const char* spec)
+{
+    // downscale factor, blur rounds, hsl lightness:saturation, darken factor
+    // (applied when the mean brightness is over 100 like -b), vignette
+    // strength:radius, tint r:g:b:amount. scale takes none, the output
+    // keeps the source size
+    const float defaults[FX_COUNT][4] = {
+        { downscale }, { (float)rounds }, { 0 }, { 1.0f, 1.0f }, { 0.8f }, { 0.5f, 0.5f },
+        { 1.0f, 1.0f, 1.0f, 0.2f },
+    };
 
-    GError* error = NULL;
-    if (!gdk_pixbuf_save(pixbuf, new_path.c_str(), suffix.c_str(), &error, NULL)) {
-        err_quit("%s\n", error->message);
+    string list = spec;
+    int seen[FX_COUNT] = { 0 }, blur_at = -1, down_at = -1, scale_at = -1;
+    bool given_rounds = false;
+    for (size_t at = 0; at <= list.size(); ) {
+        size_t end = min(list.find(',', at), list.size());
+        string item = list.substr(at, end - at);
+        size_t eq = item.find('=');
+        string name = item.substr(0, eq);
+
+        effect_stage st = { FX_COUNT, { 0 } };
+        for (int i = 0; i < FX_COUNT; i++) {
+            if (name == fx_names[i]) st.kind = i;
+        }
+        if (st.kind == FX_COUNT) {
+            err_quit("-E: unknown effect %s\n", name.c_str());
+        }
+        memcpy(st.v, defaults[st.kind], sizeof st.v);
+        if (eq != string::npos && st.kind == FX_SCALE) {
+            err_quit("-E: scale takes no value, the output keeps the source size\n");
+        }
+        if (eq != string::npos) {
+            sscanf(item.c_str() + eq + 1, "%f:%f:%f:%f", &st.v[0], &st.v[1], &st.v[2], &st.v[3]);
+        }
+
+        int pos = (int)effects.size();
+        if (st.kind == FX_BLUR) blur_at = pos;
+        if (st.kind == FX_BLUR && eq != string::npos) given_rounds = true;
+        if (st.kind == FX_DOWNSCALE) down_at = pos;
+        if (st.kind == FX_DOWNSCALE && eq != string::npos) givenParams |= GIVEN_DOWNSCALE;
+        if (st.kind == FX_SCALE) scale_at = pos;
+        if (++seen[st.kind] > 1 && (st.kind <= FX_SCALE || st.kind == FX_DARKEN)) {
+            err_quit("-E: %s can appear once\n", fx_names[st.kind]);
+        }
+        effects.push_back(st);
+        at = end + 1;
     }
 
+    if (blur_at < 0 || (down_at >= 0 && down_at > blur_at) || (scale_at >= 0 && scale_at < blur_at)) {
+        err_quit("-E: needs one blur, after downscale and before scale\n");
+    }
+    if (down_at >= 0) {
+        downscale = clamp_downscale(effects[down_at].v[0]);
+    }
+    rounds = max(0, (int)effects[blur_at].v[0]);
+    if (given_rounds) {
+        givenParams |= GIVEN_ROUNDS;
+    } else if (gaussSigma > 0) {
+        // -G picked the passes for the -x factor
+        rounds = passes_for_sigma(gaussSigma, radius, sigma, downscale);
+    }
 }
 
-static bool is_device_viable(int id)
+// fused programs of the current chain
+static struct fx_plan {
+    vector<effect_stage> pre, post; // per-pixel stages before and after the blur
+    GLuint downsample, output;
+    GLuint probe[2]; // brightness ahead of darken in either pass, 0 without one
+} fx;
+
+// CPU_ADJUST builds run the per-pixel stages as they always did
+#ifndef CPU_ADJUST
+
+// -l, -s and -b in the order blur_image always applied them
+static vector<effect_stage> flag_effects()
 {
-    char path[128];
-    snprintf(path, sizeof path, "/sys/class/drm/card%d", id);
-    if (access(path, F_OK) != 0) {
-        return false;
-    }
+    vector<effect_stage> fx;
+    if (adjustHSL) fx.push_back(effect_stage{ FX_HSL, { lightness, saturation } });
+    fx.push_back(effect_stage{ FX_BLUR, { (float)rounds } });
+    if (adjustBrightness) fx.push_back(effect_stage{ FX_DARKEN, { 0.8f } });
+    return fx;
+}
 
-    char buf[512];
-    snprintf(buf, sizeof buf, "%s/device/enable", path);
-    
-    FILE* fp = fopen(buf, "r");
-    if (!fp) {
-        return false;
+// the stages as vec4 fx(vec4) of a pass result, texCoord is the position in
+// the target. with probe the stages stop at darken and the brightness it
+// looks at goes to alpha
+static string fx_function(const vector<effect_stage>& stages, bool probe, bool swap)
+{
+    string decl, body;
+    char line[256];
+    for (auto& st: stages) {
+        if (probe && st.kind == FX_DARKEN) {
+            body += "    c.a = sqrt(dot(c.rgb * c.rgb, vec3(0.241, 0.691, 0.068)));\n";
+            break;
+        }
+        switch (st.kind) {
+            case FX_HSL:
+                if (decl.find("rgb2hsv") == string::npos) decl += hsv_code;
+                snprintf(line, sizeof line, "    c.rgb = hsv2rgb(rgb2hsv(c.rgb) * vec3(1.0, %f, %f));\n",
+                        st.v[1], st.v[0]);
+                break;
+            case FX_DARKEN:
+                decl += "uniform float fx_darken;\n";
+                snprintf(line, sizeof line, "    c.rgb *= fx_darken;\n");
+                break;
+            case FX_VIGNETTE:
+                snprintf(line, sizeof line, "    c.rgb *= 1.0 - %f * smoothstep(%f, 1.0, "
+                        "length(texCoord - 0.5) * 1.4142136);\n", st.v[0], st.v[1]);
+                break;
+            case FX_TINT:
+                snprintf(line, sizeof line, "    c.rgb = mix(c.rgb, vec3(%f, %f, %f), %f);\n",
+                        st.v[0], st.v[1], st.v[2], st.v[3]);
+                break;
+            default:
+                continue;
+        }
+        body += line;
+    }
+    if (swap) {
+        body += "    c = c.bgra;\n";
     }
+    return decl + "vec4 fx(vec4 c) {\n" + body + "    return c;\n}\n";
+}
 
-    int enabled = 0;
-    fscanf(fp, "%d", &enabled);
-    fclose(fp);
+// program stage 3 or 10 with fx() applied to its result, cached by source
+static GLuint fused_program(int stage, const string& fx)
+{
+    GLchar* src = stage == 10 ? build_shader_template(vs_downsample, 0.25f / pass_factor()) :
+        strdup(vs_direct);
+    string key = string(src) + fx;
+    auto it = program_cache.find(key);
+    if (it != program_cache.end()) {
+        free(src);
+        return it->second;
+    }
 
-    // nouveau write 2, others 1
-    return enabled > 0;
+    string vs = src;
+    free(src);
+    vs.replace(vs.find("void main()"), strlen("void main()"), "void sample_main()");
+    vs += fx + "void main() {\n    sample_main();\n    outColor = fx(outColor);\n}\n";
+    GLuint program = link_program(ts_code, vs.c_str());
+    program_cache[key] = program;
+    return program;
 }
 
-static string choose_best_card(const vector<string>& vs)
+static bool has_darken(const vector<effect_stage>& stages)
 {
-    for (auto card: vs) {
-        char buf[1024] = {0};
-        int id = std::stoi(card.substr(card.size()-1));
-        snprintf(buf, sizeof buf, "/sys/class/drm/card%d/device/driver", id);
+    for (auto& st: stages) {
+        if (st.kind == FX_DARKEN) return true;
+    }
+    return false;
+}
 
-        char buf2[1024] = {0};
-        readlink(buf, buf2, sizeof buf2);
-        string driver = basename(buf2);
-        if (driver == "i915") {
-            return card;
-        } 
+static void build_effects()
+{
+    fx.pre.clear();
+    fx.post.clear();
+    bool blurred = false;
+    for (auto& st: effects.empty() ? flag_effects() : effects) {
+        if (st.kind == FX_BLUR) blurred = true;
+        else if (st.kind >= FX_HSL) (blurred ? fx.post : fx.pre).push_back(st);
     }
 
-    return vs[0];
+    bool swap = streamFormat == STREAM_BGRA;
+    fx.downsample = fused_program(10, fx_function(fx.pre, false, false));
+    fx.output = fused_program(3, fx_function(fx.post, false, swap));
+    fx.probe[0] = has_darken(fx.pre) ? fused_program(10, fx_function(fx.pre, true, false)) : 0;
+    fx.probe[1] = has_darken(fx.post) ? fused_program(3, fx_function(fx.post, true, false)) : 0;
 }
 
-static void open_best_device()
+// the darken factor of a pass drawn from input, measured at tex size by its
+// probe program like adjust_brightness() does
+static float darken_factor(const vector<effect_stage>& stages, GLuint probe, GLuint input)
 {
-    vector<string> viables;
-    string card = "/dev/dri/card0";
-    const char* const tmpl = "/dev/dri/card%d";
-    for (int i = 0; i < 4; i++) {
-        char buf[128];
-        snprintf(buf, 127, tmpl, i);
-        if (is_device_viable(i)) {
-            viables.push_back(buf);
-        }
+    if (!probe) {
+        return 1.0f;
     }
 
-    if (viables.size() == 0) {
-        err_quit("no card found\n");
+    GLuint tex = 0, fb = 0;
+    if (!acquire_target(ctx.tex_width, ctx.tex_height, GL_RGBA8, &tex, &fb)) {
+        err_quit("brightness target exceeds the -M ceiling\n");
     }
+    glViewport(0, 0, ctx.tex_width, ctx.tex_height);
+    glBindFramebuffer(GL_FRAMEBUFFER, fb);
+    glBindTexture(GL_TEXTURE_2D, input);
+    glUseProgram(probe);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
 
-    card = choose_best_card(viables);
+    int count = ctx.tex_width * ctx.tex_height;
+    vector<unsigned int> clr(count);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, ctx.tex_width, ctx.tex_height, GL_RGBA, GL_UNSIGNED_BYTE, clr.data());
+    release_target(&tex, &fb);
 
-    std::cerr << "try to open " << card << endl;
-    ctx.fd = open(card.c_str(), O_RDWR|O_CLOEXEC|O_NONBLOCK);
-    if (ctx.fd < 0) { 
-        err_quit("%s\n", strerror(errno));
+    long total = 0;
+    for (int i = 0; i < count; i++) {
+        total += (clr[i] >> 24) & 0xff;
+    }
+    cerr << "brightness: " << total / count << endl;
+
+    for (auto& st: stages) {
+        if (st.kind == FX_DARKEN) return total / count > 100 ? st.v[0] : 1.0f;
     }
+    return 1.0f;
 }
+#endif
 
-static void open_drm_device()
+static void draw_fused(GLuint program, float darken)
 {
-    if (drmdev != NULL && access(drmdev, F_OK) == 0) {
-        std::cerr << "try to open " << drmdev << endl;
-        ctx.fd = open(drmdev, O_RDWR|O_CLOEXEC|O_NONBLOCK);
-        if (ctx.fd < 0) {
-            open_best_device();
-        }
-    } else {
-        open_best_device();
+    glUseProgram(program);
+    GLint loc = glGetUniformLocation(program, "fx_darken");
+    if (loc >= 0) {
+        glUniform1f(loc, darken);
     }
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+}
 
-    //drmSetMaster(ctx.fd);
+// limit tex size draws to rows [y0, y1), all rows turn the scissor off
+static void scissor_rows(int y0, int y1)
+{
+    if (y0 <= 0 && y1 >= ctx.tex_height) {
+        glDisable(GL_SCISSOR_TEST);
+        return;
+    }
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(0, y0, ctx.tex_width, max(0, y1 - y0));
 }
 
-static void setup_context()
+// run all passes from ctx.tex, result is drawn into outFb at full size
+static void render_passes(GLuint outFb)
 {
-    open_drm_device();
+    trace_gpu(NULL);
+#ifdef CPU_ADJUST
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
 
-    ctx.gbm = gbm_create_device(ctx.fd);
-    printf("backend name: %s\n", gbm_device_get_backend_name(ctx.gbm));
+    glDisable(GL_DEPTH_TEST);
+
+    downsample_source();
 
-    ctx.gbm_surface = gbm_surface_create(ctx.gbm, ctx.width,
-            ctx.height, GBM_FORMAT_XRGB8888,
-            GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-    if (!ctx.gbm_surface) {
-        printf("cannot create gbm surface (%d): %m", errno);
-        exit(-EFAULT);
+    if (adjustHSL) {
+        adjust_hsl(ctx.downsampleTex);
     }
 
-    EGLint major;
-    EGLint minor;
-    const char *extensions;
-    ctx.display = eglGetDisplay(ctx.gbm);
-    eglInitialize(ctx.display, &major, &minor);
-    extensions = eglQueryString(ctx.display, EGL_EXTENSIONS);
+    blur_rounds(0, rounds);
+    draw_output(outFb, ctx.width, ctx.height);
+#else
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+    glDisable(GL_DEPTH_TEST);
 
-    if (!strstr(extensions, "EGL_KHR_surfaceless_context")) {
-        err_quit("%s\n", "need EGL_KHR_surfaceless_context extension");
-    }
+    // the reduced source goes straight into the target the blur rounds
+    // start from, no texture is kept for it. rows a streamed upload has
+    // drawn already are left alone
+    GLuint src = reduced_source(ctx.width, ctx.height);
+    float darken = darken_factor(fx.pre, fx.probe[0], src);
+    glViewport(0, 0, ctx.tex_width, ctx.tex_height);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[1]);
+    glBindTexture(GL_TEXTURE_2D, src);
+    scissor_rows(ctx.reduced_rows, ctx.tex_height);
+    draw_fused(fx.downsample, darken);
+    trace_gpu("downsample");
 
-    if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+    for (int i = 0; i < rounds; i++) {
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[0]);
+        glBindTexture(GL_TEXTURE_2D, ctx.fbTex[1]);
+        glUseProgram(ctx.program);
+        scissor_rows(i == 0 ? ctx.vblur_rows : 0, ctx.tex_height);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("vertical blur");
+        scissor_rows(0, ctx.tex_height);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[1]);
+        glBindTexture(GL_TEXTURE_2D, ctx.fbTex[0]);
+        glUseProgram(ctx.programH);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("horizontal blur");
+    }
+
+    scissor_rows(0, ctx.tex_height);
+    ctx.reduced_rows = ctx.vblur_rows = 0;
+
+    darken = darken_factor(fx.post, fx.probe[1], ctx.fbTex[1]);
+    glViewport(0, 0, ctx.width, ctx.height);
+    glBindFramebuffer(GL_FRAMEBUFFER, outFb);
+    glBindTexture(GL_TEXTURE_2D, ctx.fbTex[1]);
+    draw_fused(fx.output, darken);
+    trace_gpu("output");
+#endif
+}
+
+// -T prints how long every stage took
+static vector<pair<const char*, double> > stage_times;
+static double stage_mark = 0;
+static double decode_ms = -1; // decoding overlaps the stages above
+static double preview_ms = -1; // -Q, from the start of decoding
+
+static void stage_done(const char* name)
+{
+    trace_span(name, stage_mark);
+    double now = now_ms();
+    stage_times.push_back(make_pair(name, now - stage_mark));
+    stage_mark = now;
+}
+
+static void print_stats()
+{
+    if (decode_ms >= 0) {
+        fprintf(stderr, "%s %.2f ms (overlapped), ", ctx.img_map ? "map" : "decode", decode_ms);
+    }
+
+    double total = 0, first_pixel = 0;
+    for (auto& st: stage_times) {
+        fprintf(stderr, "%s %.2f ms, ", st.first, st.second);
+        total += st.second;
+        if (strcmp(st.first, "render") == 0) first_pixel = total;
+    }
+    if (preview_ms >= 0) {
+        fprintf(stderr, "first preview %.2f ms, ", preview_ms);
+    }
+    if (pool.created) {
+        fprintf(stderr, "targets %u created %u reused %.1f MiB peak, ", pool.created,
+                pool.reused, pool.peak / 1048576.0);
+    }
+    fprintf(stderr, "first pixel %.2f ms, total %.2f ms\n", first_pixel, total);
+}
+
+static string output_path()
+{
+    string new_path = string("blurred.") + ctx.img_path;
+    if (outfile) new_path = outfile;
+    return new_path;
+}
+
+/*
+ * uncompressed images skip the codecs, inputs are mapped and handed to
+ * glTexImage2D as they are and outputs are read back into the mapped file.
+ * besides binary PPM (P6) and PAM (P7) with maxval 255 there is a raw
+ * format: this header followed by tightly packed rows, top row first.
+ */
+struct raw_header {
+    char magic[4]; // "BLRW"
+    uint32_t width; // little endian
+    uint32_t height;
+    uint16_t ncomp; // 3 (RGB) or 4 (RGBA)
+    uint16_t reserved;
+};
+
+// returns offset of the pixel data, or -1 if not an uncompressed image
+static long parse_image_header(const char* p, size_t len, int* w, int* h, int* n)
+{
+    if (len >= sizeof(raw_header) && memcmp(p, "BLRW", 4) == 0) {
+        const raw_header* hdr = (const raw_header*)p;
+        *w = hdr->width;
+        *h = hdr->height;
+        *n = hdr->ncomp;
+        return sizeof(raw_header);
+    }
+
+    if (len < 3 || p[0] != 'P') {
+        return -1;
+    }
+
+    if (p[1] == '6') {
+        int vals[3];
+        size_t pos = 2;
+        for (int i = 0; i < 3; i++) {
+            while (pos < len && (isspace(p[pos]) || p[pos] == '#')) {
+                if (p[pos] == '#') {
+                    while (pos < len && p[pos] != '\n') pos++;
+                } else {
+                    pos++;
+                }
+            }
+            vals[i] = 0;
+            while (pos < len && isdigit(p[pos])) {
+                vals[i] = vals[i] * 10 + p[pos++] - '0';
+            }
+        }
+
+        // exactly one whitespace after maxval
+        if (vals[2] != 255 || pos >= len) return -1;
+        *w = vals[0];
+        *h = vals[1];
+        *n = 3;
+        return pos + 1;
+    }
+
+    if (p[1] == '7') {
+        const char* end = (const char*)memmem(p, min(len, (size_t)1024), "ENDHDR\n", 7);
+        if (!end) return -1;
+
+        int maxval = 0;
+        *w = *h = *n = 0;
+        for (const char* l = p; l < end; l = (const char*)memchr(l, '\n', end - l) + 1) {
+            if (strncmp(l, "WIDTH ", 6) == 0) *w = atoi(l + 6);
+            else if (strncmp(l, "HEIGHT ", 7) == 0) *h = atoi(l + 7);
+            else if (strncmp(l, "DEPTH ", 6) == 0) *n = atoi(l + 6);
+            else if (strncmp(l, "MAXVAL ", 7) == 0) maxval = atoi(l + 7);
+        }
+
+        if (maxval != 255) return -1;
+        return end + 7 - p;
+    }
+
+    return -1;
+}
+
+static bool map_image(const char* path)
+{
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    // only map files that look uncompressed
+    char magic[4] = {0};
+    struct stat st;
+    if (fstat(fd, &st) < 0 || pread(fd, magic, 4, 0) != 4 ||
+            (memcmp(magic, "BLRW", 4) != 0 && memcmp(magic, "P6", 2) != 0 &&
+             memcmp(magic, "P7", 2) != 0)) {
+        close(fd);
+        return false;
+    }
+
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    int w, h, n;
+    long off = parse_image_header((const char*)p, st.st_size, &w, &h, &n);
+    if (off < 0 || w <= 0 || h <= 0 || (n != 3 && n != 4) ||
+            (size_t)st.st_size < off + (size_t)w * h * n) {
+        munmap(p, st.st_size);
+        return false;
+    }
+
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    ctx.img_map = p;
+    ctx.img_map_size = st.st_size;
+    ctx.img_data = (unsigned char*)p + off;
+    ctx.width = w;
+    ctx.height = h;
+    ctx.ncomp = n;
+    ctx.stride = w * n;
+    return true;
+}
+
+// components an output keeps: images without alpha and formats that
+// cannot store it are read back and encoded as RGB
+static int output_components(const string& path)
+{
+    auto suffix = path.substr(path.find_last_of('.')+1, path.size());
+    if (ctx.ncomp == 3 || suffix == "ppm" || suffix == "jpg" || suffix == "jpeg" ||
+            suffix == path || suffix.empty()) {
+        return 3;
+    }
+    return 4;
+}
+
+// rows of w RGBA texels, stride bytes apart (0 for tightly packed), to n
+// components
+static void pack_pixels(unsigned char* dst, const unsigned char* rgba, int w, int h, int n,
+        int stride = 0)
+{
+    if (!stride) stride = w * 4;
+    for (int y = 0; y < h; y++) {
+        const unsigned char* src = rgba + (size_t)y * stride;
+        unsigned char* out = dst + (size_t)y * w * n;
+        if (n == 4) {
+            memcpy(out, src, (size_t)w * 4);
+            continue;
+        }
+        for (int x = 0; x < w; x++) {
+            out[x*3] = src[x*4];
+            out[x*3+1] = src[x*4+1];
+            out[x*3+2] = src[x*4+2];
+        }
+    }
+}
+
+// tightly packed rows of n components from the bound framebuffer
+static void read_pixels(void* data, int w, int h, int n)
+{
+    double start = trace_now();
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    GLint read_fmt = 0, read_type = 0;
+    if (n == 3) {
+        glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &read_fmt);
+        glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &read_type);
+    }
+
+    if (n == 4) {
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, data);
+    } else if (read_fmt == GL_RGB && read_type == GL_UNSIGNED_BYTE) {
+        glReadPixels(0, 0, w, h, GL_RGB, GL_UNSIGNED_BYTE, data);
+    } else {
+        // RGBA is the only readback every implementation has
+        unsigned char* rgba = (unsigned char*)malloc((size_t)w * h * 4);
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+        pack_pixels((unsigned char*)data, rgba, w, h, 3);
+        free(rgba);
+    }
+    trace_span("readback", start);
+    trace_gpu_collect(false);
+}
+
+// write a w x h image into a mapped PPM/PAM/raw file, returns false for
+// other formats. pixels come from the bound framebuffer, or from rgba rows
+// when given
+static bool write_mapped_image(const string& path, int w, int h,
+        const unsigned char* rgba = NULL, int stride = 0)
+{
+    auto suffix = path.substr(path.find_last_of('.')+1, path.size());
+    int n = output_components(path);
+    char header[128];
+    int hlen;
+    if (suffix == "ppm") {
+        hlen = snprintf(header, sizeof header, "P6\n%d %d\n255\n", w, h);
+    } else if (suffix == "pam") {
+        hlen = snprintf(header, sizeof header,
+                "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                w, h, n, n == 4 ? "RGB_ALPHA" : "RGB");
+    } else if (suffix == "raw") {
+        raw_header hdr = { {'B', 'L', 'R', 'W'}, (uint32_t)w, (uint32_t)h, (uint16_t)n, 0 };
+        memcpy(header, &hdr, sizeof hdr);
+        hlen = sizeof hdr;
+    } else {
+        return false;
+    }
+
+    cout << "new_path: " << path << endl;
+    size_t row = (size_t)w * n;
+    size_t size = hlen + row * h;
+    int fd = open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        err_quit("%s: %s\n", path.c_str(), strerror(errno));
+    }
+    char* map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        err_quit("%s: %s\n", path.c_str(), strerror(errno));
+    }
+    memcpy(map, header, hlen);
+
+    if (rgba) {
+        pack_pixels((unsigned char*)map + hlen, rgba, w, h, n, stride);
+    } else {
+        read_pixels(map + hlen, w, h, n);
+    }
+
+    munmap(map, size);
+    return true;
+}
+
+// gdk-pixbuf's default, the banded encoder writes the same
+#define JPEG_QUALITY 75
+
+static void save_image(char* data, int w, int h, int n, const string& new_path)
+{
+    double start = trace_now();
+#ifdef PARALLEL_ENCODE
+    // JPEG and PNG are encoded in bands on all cores
+    if (encode_parallel(new_path, (const unsigned char*)data, w, h, n, JPEG_QUALITY)) {
+        cout << "new_path: " << new_path << endl;
+        trace_span("encode " + new_path, start);
+        return;
+    }
+#endif
+    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_data((const guchar*)data, 
+            GDK_COLORSPACE_RGB, n == 4, 8, w,
+            h, w * n, NULL, NULL);
+
+    cout << "new_path: " << new_path << endl;
+    auto suffix = new_path.substr(new_path.find_last_of('.')+1, new_path.size());
+    if (suffix == "jpg" || suffix.empty()) suffix = "jpeg";
+
+    GError* error = NULL;
+    char quality[8];
+    snprintf(quality, sizeof quality, "%d", JPEG_QUALITY);
+    gboolean saved = suffix == "jpeg" ?
+        gdk_pixbuf_save(pixbuf, new_path.c_str(), "jpeg", &error, "quality", quality, NULL) :
+        gdk_pixbuf_save(pixbuf, new_path.c_str(), suffix.c_str(), &error, NULL);
+    if (!saved) {
+        err_quit("%s\n", error->message);
+    }
+    g_object_unref(pixbuf);
+    trace_span("encode " + new_path, start);
+}
+
+/*
+ * a gbm buffer object imported as an EGLImage and attached to a framebuffer,
+ * so the last pass draws into memory that can leave the process as a dma-buf
+ * (daemon BLUR_FLAG_DMABUF) or be read through gbm_bo_map (-Z) without a
+ * glReadPixels copy. gbm backend only.
+ */
+#ifndef DRM_FORMAT_MOD_INVALID
+#define DRM_FORMAT_MOD_INVALID ((1ULL << 56) - 1)
+#endif
+
+struct bo_target {
+    struct gbm_bo* bo;
+    int fd; // dma-buf of bo
+    EGLImageKHR image;
+    GLuint tex, fb;
+};
+
+static void free_bo_target(bo_target& t)
+{
+    static PFNEGLDESTROYIMAGEKHRPROC destroy_image =
+        (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+
+    if (t.fb) glDeleteFramebuffers(1, &t.fb);
+    if (t.tex) glDeleteTextures(1, &t.tex);
+    if (t.image != EGL_NO_IMAGE_KHR) destroy_image(ctx.display, t.image);
+    if (t.fd >= 0) close(t.fd);
+    if (t.bo) gbm_bo_destroy(t.bo);
+    t = bo_target{ NULL, -1, EGL_NO_IMAGE_KHR, 0, 0 };
+}
+
+// w x h RGBA8888 (DRM ABGR8888), flags are gbm_bo_flags besides rendering
+static bool alloc_bo_target(bo_target& t, int w, int h, uint32_t flags)
+{
+    static PFNEGLCREATEIMAGEKHRPROC create_image =
+        (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+    static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target =
+        (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)eglGetProcAddress("glEGLImageTargetTexture2DOES");
+
+    t = bo_target{ NULL, -1, EGL_NO_IMAGE_KHR, 0, 0 };
+    const char* exts = eglQueryString(ctx.display, EGL_EXTENSIONS);
+    if (!ctx.gbm || !create_image || !image_target ||
+            !strstr(exts, "EGL_EXT_image_dma_buf_import")) {
+        return false;
+    }
+
+    t.bo = gbm_bo_create(ctx.gbm, w, h, GBM_FORMAT_ABGR8888, GBM_BO_USE_RENDERING | flags);
+    if (!t.bo || (t.fd = gbm_bo_get_fd(t.bo)) < 0) {
+        free_bo_target(t);
+        return false;
+    }
+
+    uint64_t modifier = gbm_bo_get_modifier(t.bo);
+    EGLint att[32] = {
+        EGL_WIDTH, w,
+        EGL_HEIGHT, h,
+        EGL_LINUX_DRM_FOURCC_EXT, (EGLint)GBM_FORMAT_ABGR8888,
+        EGL_DMA_BUF_PLANE0_FD_EXT, t.fd,
+        EGL_DMA_BUF_PLANE0_OFFSET_EXT, (EGLint)gbm_bo_get_offset(t.bo, 0),
+        EGL_DMA_BUF_PLANE0_PITCH_EXT, (EGLint)gbm_bo_get_stride(t.bo),
+    };
+    int i = 12;
+    if (modifier != DRM_FORMAT_MOD_INVALID &&
+            strstr(exts, "EGL_EXT_image_dma_buf_import_modifiers")) {
+        att[i++] = EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT;
+        att[i++] = (EGLint)(modifier & 0xffffffff);
+        att[i++] = EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT;
+        att[i++] = (EGLint)(modifier >> 32);
+    }
+    att[i] = EGL_NONE;
+
+    t.image = create_image(ctx.display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, att);
+    if (t.image == EGL_NO_IMAGE_KHR) {
+        free_bo_target(t);
+        return false;
+    }
+
+    glGenTextures(1, &t.tex);
+    glBindTexture(GL_TEXTURE_2D, t.tex);
+    image_target(GL_TEXTURE_2D, t.image);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glGenFramebuffers(1, &t.fb);
+    glBindFramebuffer(GL_FRAMEBUFFER, t.fb);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t.tex, 0);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete) {
+        free_bo_target(t);
+        return false;
+    }
+    return true;
+}
+
+// -Z: the result is drawn into a linear buffer object and the output is
+// written from its mapping
+static void render_to_bo()
+{
+    bo_target t;
+    if (!alloc_bo_target(t, ctx.width, ctx.height, GBM_BO_USE_LINEAR)) {
+        err_quit("-Z: cannot render into a gbm buffer object\n");
+    }
+
+    setup_ubo();
+    render_passes(t.fb);
+    glFinish();
+    trace_gpu_collect(false);
+
+    // -T checks the mapping against what GL reads from the same buffer
+    vector<unsigned char> readback;
+    if (showStats) {
+        readback.resize((size_t)ctx.width * ctx.height * 4);
+        glBindFramebuffer(GL_FRAMEBUFFER, t.fb);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, ctx.width, ctx.height, GL_RGBA, GL_UNSIGNED_BYTE, readback.data());
+    }
+
+    uint32_t stride = 0;
+    void* map_data = NULL;
+    unsigned char* rgba = (unsigned char*)gbm_bo_map(t.bo, 0, 0, ctx.width, ctx.height,
+            GBM_BO_TRANSFER_READ, &stride, &map_data);
+    if (!rgba) {
+        err_quit("gbm_bo_map: %s\n", strerror(errno));
+    }
+    uint32_t fourcc = gbm_bo_get_format(t.bo);
+    fprintf(stderr, "dma-buf fourcc %.4s modifier 0x%llx stride %u offset %u\n",
+            (const char*)&fourcc, (unsigned long long)gbm_bo_get_modifier(t.bo),
+            gbm_bo_get_stride(t.bo), gbm_bo_get_offset(t.bo, 0));
+    if (showStats) {
+        int rows = 0;
+        for (int y = 0; y < ctx.height; y++) {
+            size_t row = (size_t)ctx.width * 4;
+            rows += memcmp(rgba + (size_t)y * stride, &readback[y * row], row) != 0;
+        }
+        fprintf(stderr, "dma-buf mapping %s glReadPixels, %d of %d rows differ\n",
+                rows ? "differs from" : "matches", rows, ctx.height);
+    }
+    stage_done("render");
+
+    string path = output_path();
+    if (!write_mapped_image(path, ctx.width, ctx.height, rgba, stride)) {
+        int n = output_components(path);
+        unsigned char* data = (unsigned char*)malloc((size_t)ctx.width * ctx.height * n);
+        pack_pixels(data, rgba, ctx.width, ctx.height, n, stride);
+        save_image((char*)data, ctx.width, ctx.height, n, path);
+        free(data);
+    }
+    gbm_bo_unmap(t.bo, map_data);
+    free_bo_target(t);
+    stage_done("encode");
+}
+
+static void render()
+{
+    if (zeroCopy) {
+        render_to_bo();
+        return;
+    }
+
+    setup_ubo();
+    render_passes(ctx.outFb);
+
+    if (write_mapped_image(output_path(), ctx.width, ctx.height)) {
+        stage_done("render");
+        return;
+    }
+
+    int n = output_components(output_path());
+    char* data = (char*)malloc(ctx.width * ctx.height * n);
+    read_pixels(data, ctx.width, ctx.height, n);
+    stage_done("render");
+
+    save_image(data, ctx.width, ctx.height, n, output_path());
+    free(data);
+    stage_done("encode");
+}
+
+/*
+ * -A: time candidate plans of the current perceived blur on this device and
+ * keep the fastest one whose PSNR against an exact Gaussian stays above the
+ * bound. the choice is stored per renderer, later runs asking for the same
+ * blur pick it up without tuning again.
+ */
+struct blur_plan {
+    float downscale;
+    GLint radius;
+    int rounds;
+    GLfloat sigma;
+    bool taps;
+};
+
+static float target_sigma()
+{
+    return equivalent_sigma(radius, sigma, rounds, downscale);
+}
+
+static string renderer_key()
+{
+    const char* vendor = (const char*)glGetString(GL_VENDOR);
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    string key = string(vendor ? vendor : "") + " " + (renderer ? renderer : "");
+    replace(key.begin(), key.end(), '\t', ' ');
+    return key;
+}
+
+// $XDG_CONFIG_HOME/blur_image/profile unless -P names one, "none" disables it
+static string profile_file()
+{
+    if (profile_path) {
+        return strcmp(profile_path, "none") == 0 ? "" : profile_path;
+    }
+
+    const char* config = getenv("XDG_CONFIG_HOME");
+    if (config && *config) {
+        return string(config) + "/blur_image/profile";
+    }
+    const char* home = getenv("HOME");
+    return home ? string(home) + "/.config/blur_image/profile" : "";
+}
+
+// one line per renderer and target sigma:
+// renderer \t sigma \t downscale radius passes sample_distance taps
+static bool load_profile(float target, blur_plan& plan)
+{
+    string path = profile_file();
+    FILE* fp = path.empty() ? NULL : fopen(path.c_str(), "r");
+    if (!fp) {
+        return false;
+    }
+
+    string key = renderer_key();
+    char line[512];
+    bool found = false;
+    while (!found && fgets(line, sizeof line, fp)) {
+        char* tab = strchr(line, '\t');
+        if (!tab || key.compare(0, string::npos, line, tab - line) != 0) {
+            continue;
+        }
+
+        float s;
+        int taps;
+        if (sscanf(tab + 1, "%f\t%f %d %d %f %d", &s, &plan.downscale, &plan.radius,
+                    &plan.rounds, &plan.sigma, &taps) == 6 && fabsf(s - target) < 0.05f) {
+            plan.taps = taps;
+            found = true;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void save_profile(float target, const blur_plan& plan)
+{
+    string path = profile_file();
+    if (path.empty()) {
+        return;
+    }
+
+    // keep entries of other renderers and blurs
+    string key = renderer_key(), kept;
+    FILE* fp = fopen(path.c_str(), "r");
+    if (fp) {
+        char line[512];
+        float s;
+        while (fgets(line, sizeof line, fp)) {
+            char* tab = strchr(line, '\t');
+            if (tab && key.compare(0, string::npos, line, tab - line) == 0 &&
+                    sscanf(tab + 1, "%f", &s) == 1 && fabsf(s - target) < 0.05f) {
+                continue;
+            }
+            kept += line;
+        }
+        fclose(fp);
+    }
+
+    for (size_t at = path.find('/', 1); at != string::npos; at = path.find('/', at + 1)) {
+        mkdir(path.substr(0, at).c_str(), 0755);
+    }
+
+    string tmp = path + ".tmp";
+    fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", tmp.c_str(), strerror(errno));
+        return;
+    }
+    fprintf(fp, "%s%s\t%.2f\t%g %d %d %g %d\n", kept.c_str(), key.c_str(), target,
+            plan.downscale, plan.radius, plan.rounds, plan.sigma, plan.taps);
+    if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return;
+    }
+    cerr << "profile saved to " << path << endl;
+}
+
+static void use_plan(const blur_plan& plan)
+{
+    downscale = plan.downscale;
+    radius = plan.radius;
+    rounds = plan.rounds;
+    sigma = plan.sigma;
+    vertexTaps = plan.taps;
+}
+
+// a stored plan fills in the parameters not given on the command line,
+// false when the result no longer reaches the blur the plan was tuned for
+static bool merge_plan(blur_plan& plan, float target)
+{
+    if (givenParams & GIVEN_DOWNSCALE) plan.downscale = downscale;
+    if (givenParams & GIVEN_RADIUS) plan.radius = radius;
+    if (givenParams & GIVEN_ROUNDS) plan.rounds = rounds;
+    if (givenParams & GIVEN_SIGMA) plan.sigma = sigma;
+    if (givenParams & GIVEN_TAPS) plan.taps = vertexTaps;
+    float s = equivalent_sigma(plan.radius, plan.sigma, plan.rounds, plan.downscale);
+    return fabsf(s - target) <= target * 0.1f;
+}
+
+// candidates with the same perceived blur as the current parameters, grouped
+// by downscale factor so targets are reallocated once per factor
+static vector<blur_plan> candidate_plans(float target)
+{
+    // 1/8 and 1/16 reduce through the pyramid, a chain of halvings with
+    // the blur rounds at the lowest level
+    static const float factors[] = { 0.5f, 0.25f, 0.125f, 0.0625f };
+    static const float distances[] = { 1.0f, 1.5f, 2.0f };
+
+    vector<blur_plan> plans;
+    for (float f: factors) {
+        float scale = 1.0f / f;
+        float blur = target * target - (scale * scale - 1.0f) / 12.0f - scale * scale / 6.0f;
+        for (int p = 1; p <= 3 && blur > 0; p++) {
+            for (float S: distances) {
+                // invert equivalent_sigma for the radius
+                float r = 2.0f * blur / (p * S * S * scale * scale) - 1.0f;
+                GLint odd = max(min(2 * (int)lrintf((r - 1.0f) / 2.0f) + 1, 49), 3);
+                if (fabsf(equivalent_sigma(odd, S, p, f) - target) > target * 0.1f) {
+                    continue;
+                }
+                plans.push_back({f, odd, p, S, false});
+                if (S == 1.0f) {
+                    plans.push_back({f, odd, p, S, true});
+                }
+            }
+        }
+    }
+    return plans;
+}
+
+// source image as the CPU reference sees it
+static void source_image(float_image& img)
+{
+    int stride = ctx.stride ? ctx.stride : ctx.width * ctx.ncomp;
+    img.width = ctx.width;
+    img.height = ctx.height;
+    img.ncomp = ctx.ncomp;
+    img.pixels.resize((size_t)ctx.width * ctx.height * ctx.ncomp);
+    for (int y = 0; y < ctx.height; y++) {
+        const unsigned char* row = (const unsigned char*)ctx.img_data + (size_t)y * stride;
+        copy(row, row + ctx.width * ctx.ncomp, &img.pixels[(size_t)y * ctx.width * ctx.ncomp]);
+    }
+}
+
+static void autotune()
+{
+    float target = target_sigma();
+    cerr << "tuning for sigma " << target << ", PSNR >= " << autotuneBound << " dB" << endl;
+
+    float_image src, ref, result;
+    source_image(src);
+    gaussian_blur(src, target, ref);
+
+    // measure the blur alone, brightness and HSL do not change with the plan
+    bool hsl = adjustHSL, brt = adjustBrightness;
+    adjustHSL = adjustBrightness = false;
+
+    const blur_plan current = { downscale, radius, rounds, sigma, vertexTaps };
+    blur_plan best = current;
+    double best_ms = -1;
+    vector<unsigned char> data((size_t)ctx.width * ctx.height * 4);
+    float allocated = downscale;
+
+    for (auto& plan: candidate_plans(target)) {
+        use_plan(plan);
+        if (downscale != allocated) {
+            free_targets();
+            ctx.tex_width = max(1, (int)(ctx.width * downscale));
+            ctx.tex_height = max(1, (int)(ctx.height * downscale));
+            alloc_targets();
+            upload_source();
+            allocated = downscale;
+        }
+        build_kernel();
+        if (vertexTaps && !kernelTaps) {
+            continue; // fell back to the plan without taps
+        }
+        build_programs();
+        finish_programs();
+        setup_ubo();
+
+        // warm up, then the median of five
+        render_passes(ctx.outFb);
+        glFinish();
+        double times[5];
+        for (auto& t: times) {
+            double start = now_ms();
+            render_passes(ctx.outFb);
+            glFinish();
+            t = now_ms() - start;
+        }
+        sort(times, times + 5);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.outFb);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, ctx.width, ctx.height, GL_RGBA, GL_UNSIGNED_BYTE, data.data());
+        result.width = ctx.width;
+        result.height = ctx.height;
+        result.ncomp = 4;
+        result.pixels.assign(data.begin(), data.end());
+        double quality = psnr(result, ref);
+
+        fprintf(stderr, "x %-5g r %2d p %d S %-3g t %d: %7.2f ms %6.2f dB\n", plan.downscale,
+                plan.radius, plan.rounds, plan.sigma, plan.taps, times[2], quality);
+        if (quality >= autotuneBound && (best_ms < 0 || times[2] < best_ms)) {
+            best = plan;
+            best_ms = times[2];
+        }
+    }
+
+    adjustHSL = hsl;
+    adjustBrightness = brt;
+    if (best_ms < 0) {
+        fprintf(stderr, "no plan reaches %g dB, keep the given parameters\n", autotuneBound);
+    } else {
+        fprintf(stderr, "selected -x %g -r %d -p %d -S %g%s\n", best.downscale, best.radius,
+                best.rounds, best.sigma, best.taps ? " -t" : "");
+        save_profile(target, best);
+    }
+
+    // back to the chosen plan for the real render
+    use_plan(best_ms < 0 ? current : best);
+    free_targets();
+    ctx.tex_width = max(1, (int)(ctx.width * downscale));
+    ctx.tex_height = max(1, (int)(ctx.height * downscale));
+    alloc_targets();
+    upload_source();
+    build_kernel();
+    build_programs();
+    finish_programs();
+}
+
+static bool read_full(int fd, void* buf, size_t len)
+{
+    char* p = (char*)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void* buf, size_t len)
+{
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// y4m header lines are short, read them bytewise so no frame data is consumed
+static bool read_line(int fd, string& line)
+{
+    char c;
+    line.clear();
+    while (read_full(fd, &c, 1)) {
+        if (c == '\n') return true;
+        line += c;
+    }
+    return false;
+}
+
+static inline unsigned char clamp8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// BT.601 limited range, chroma planes are 4:2:0
+static void yuv420_to_rgba(const unsigned char* yuv, unsigned char* rgba, int w, int h)
+{
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    const unsigned char* u = yuv + w * h;
+    const unsigned char* v = u + cw * ch;
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            int c = 298 * (yuv[j*w+i] - 16);
+            int d = u[(j/2)*cw + i/2] - 128;
+            int e = v[(j/2)*cw + i/2] - 128;
+            rgba[0] = clamp8((c + 409 * e + 128) >> 8);
+            rgba[1] = clamp8((c - 100 * d - 208 * e + 128) >> 8);
+            rgba[2] = clamp8((c + 516 * d + 128) >> 8);
+            rgba[3] = 255;
+            rgba += 4;
+        }
+    }
+}
+
+static void rgba_to_yuv420(const unsigned char* rgba, unsigned char* yuv, int w, int h)
+{
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+    unsigned char* u = yuv + w * h;
+    unsigned char* v = u + cw * ch;
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            const unsigned char* p = rgba + (j*w + i) * 4;
+            yuv[j*w+i] = clamp8(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16);
+        }
+    }
+
+    for (int j = 0; j < ch; j++) {
+        for (int i = 0; i < cw; i++) {
+            int r = 0, g = 0, b = 0, n = 0;
+            for (int y = j*2; y < min(j*2+2, h); y++) {
+                for (int x = i*2; x < min(i*2+2, w); x++) {
+                    const unsigned char* p = rgba + (y*w + x) * 4;
+                    r += p[0]; g += p[1]; b += p[2]; n++;
+                }
+            }
+            r /= n; g /= n; b /= n;
+            u[j*cw+i] = clamp8(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            v[j*cw+i] = clamp8(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
+    }
+}
+
+// blur fixed size frames from in_fd to out_fd, the context and every GL
+// object live across frames. frame N is uploaded and rendered while frame
+// N-1 is read back, through two unpack and two pack buffers
+static void stream_frames(int in_fd, int out_fd)
+{
+    int w = ctx.width, h = ctx.height;
+    size_t frame_sz = (size_t)w * h * 4;
+    size_t yuv_sz = (size_t)w * h + 2 * (size_t)((w+1)/2) * ((h+1)/2);
+    vector<unsigned char> yuv(streamFormat == STREAM_Y4M ? yuv_sz : 0);
+
+    glGenBuffers(2, ctx.upPbo);
+    glGenBuffers(2, ctx.downPbo);
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ctx.upPbo[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, frame_sz, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx.downPbo[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frame_sz, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    setup_ubo();
+
+    GLsync fences[2] = {0, 0};
+    double started[2] = {0, 0};
+    vector<double> latencies;
+    bool eof = false;
+    double t0 = now_ms();
+
+    for (long k = 0; ; k++) {
+        int slot = k & 1, prev = slot ^ 1;
+
+        if (!eof) {
+            started[slot] = now_ms();
+            bool ok = true;
+            string line;
+            if (streamFormat == STREAM_Y4M) {
+                ok = read_line(in_fd, line) && line.compare(0, 5, "FRAME") == 0 &&
+                    read_full(in_fd, yuv.data(), yuv_sz);
+            }
+
+            if (ok) {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ctx.upPbo[slot]);
+                void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, frame_sz,
+                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+                if (streamFormat == STREAM_Y4M) {
+                    yuv420_to_rgba(yuv.data(), (unsigned char*)dst, w, h);
+                } else {
+                    ok = read_full(in_fd, dst, frame_sz);
+                }
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            }
+
+            if (ok) {
+                glBindTexture(GL_TEXTURE_2D, ctx.tex);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+                render_passes(ctx.outFb);
+
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx.downPbo[slot]);
+                glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                glFlush();
+            } else {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                eof = true;
+            }
+        }
+
+        if (!fences[prev]) {
+            if (eof) break;
+            continue;
+        }
+
+        glClientWaitSync(fences[prev], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fences[prev]);
+        fences[prev] = 0;
+        trace_gpu_collect(false);
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx.downPbo[prev]);
+        const unsigned char* src = (const unsigned char*)glMapBufferRange(
+                GL_PIXEL_PACK_BUFFER, 0, frame_sz, GL_MAP_READ_BIT);
+        bool ok;
+        if (streamFormat == STREAM_Y4M) {
+            rgba_to_yuv420(src, yuv.data(), w, h);
+            ok = write_full(out_fd, "FRAME\n", 6) && write_full(out_fd, yuv.data(), yuv_sz);
+        } else {
+            ok = write_full(out_fd, src, frame_sz);
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        if (!ok) {
+            err_quit("write frame failed: %s\n", strerror(errno));
+        }
+
+        latencies.push_back(now_ms() - started[prev]);
+    }
+
+    double elapsed = now_ms() - t0;
+    size_t n = latencies.size();
+    if (n == 0) {
+        cerr << "no frames" << endl;
+        return;
+    }
+
+    sort(latencies.begin(), latencies.end());
+    fprintf(stderr, "frames: %zu, %.2f fps, latency ms: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+            n, n * 1000.0 / elapsed, latencies[n/2], latencies[n*9/10],
+            latencies[n*99/100], latencies[n-1]);
+}
+
+static bool is_device_viable(int id)
+{
+    char path[128];
+    snprintf(path, sizeof path, "/sys/class/drm/card%d", id);
+    if (access(path, F_OK) != 0) {
+        return false;
+    }
+
+    char buf[512];
+    snprintf(buf, sizeof buf, "%s/device/enable", path);
+    
+    FILE* fp = fopen(buf, "r");
+    if (!fp) {
+        return false;
+    }
+
+    int enabled = 0;
+    fscanf(fp, "%d", &enabled);
+    fclose(fp);
+
+    // nouveau write 2, others 1
+    return enabled > 0;
+}
+
+static string choose_best_card(const vector<string>& vs)
+{
+    for (auto card: vs) {
+        char buf[1024] = {0};
+        int id = std::stoi(card.substr(card.size()-1));
+        snprintf(buf, sizeof buf, "/sys/class/drm/card%d/device/driver", id);
+
+        char buf2[1024] = {0};
+        readlink(buf, buf2, sizeof buf2);
+        string driver = basename(buf2);
+        if (driver == "i915") {
+            return card;
+        } 
+    }
+
+    return vs[0];
+}
+
+static void open_best_device()
+{
+    vector<string> viables;
+    string card = "/dev/dri/card0";
+    const char* const tmpl = "/dev/dri/card%d";
+    for (int i = 0; i < 4; i++) {
+        char buf[128];
+        snprintf(buf, 127, tmpl, i);
+        if (is_device_viable(i)) {
+            viables.push_back(buf);
+        }
+    }
+
+    if (viables.size() == 0) {
+        err_quit("no card found\n");
+    }
+
+    card = choose_best_card(viables);
+
+    std::cerr << "try to open " << card << endl;
+    ctx.fd = open(card.c_str(), O_RDWR|O_CLOEXEC|O_NONBLOCK);
+    if (ctx.fd < 0) { 
+        err_quit("%s\n", strerror(errno));
+    }
+}
+
+static void open_drm_device()
+{
+    if (drmdev != NULL && access(drmdev, F_OK) == 0) {
+        std::cerr << "try to open " << drmdev << endl;
+        ctx.fd = open(drmdev, O_RDWR|O_CLOEXEC|O_NONBLOCK);
+        if (ctx.fd < 0) {
+            open_best_device();
+        }
+    } else {
+        open_best_device();
+    }
+
+    //drmSetMaster(ctx.fd);
+}
+
+#ifndef EGL_DRM_RENDER_NODE_FILE_EXT
+#define EGL_DRM_RENDER_NODE_FILE_EXT 0x3377
+#endif
+
+static PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = NULL;
+
+// gbm device on a DRM card chosen by -d or sysfs, may need privileges
+static EGLDisplay gbm_display()
+{
+    open_drm_device();
+
+    ctx.gbm = gbm_create_device(ctx.fd);
+    if (!ctx.gbm) {
+        return EGL_NO_DISPLAY;
+    }
+    printf("backend name: %s\n", gbm_device_get_backend_name(ctx.gbm));
+    return eglGetDisplay((EGLNativeDisplayType)ctx.gbm);
+}
+
+// EGL device matching -d, otherwise the first one backed by a DRM node and
+// the software device last. nothing is opened by us
+static EGLDisplay device_display(const char* client_exts)
+{
+    if (!get_platform_display || !strstr(client_exts, "EGL_EXT_platform_device")) {
+        return EGL_NO_DISPLAY;
+    }
+
+    PFNEGLQUERYDEVICESEXTPROC query_devices =
+        (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+    PFNEGLQUERYDEVICESTRINGEXTPROC query_string =
+        (PFNEGLQUERYDEVICESTRINGEXTPROC)eglGetProcAddress("eglQueryDeviceStringEXT");
+    EGLDeviceEXT devices[16];
+    EGLint n = 0;
+    if (!query_devices || !query_string || !query_devices(16, devices, &n) || n == 0) {
+        return EGL_NO_DISPLAY;
+    }
+
+    EGLDeviceEXT dev = drmdev ? NULL : devices[0];
+    for (int i = 0; i < n; i++) {
+        const char* exts = query_string(devices[i], EGL_EXTENSIONS);
+        if (!exts || !strstr(exts, "EGL_EXT_device_drm")) {
+            continue;
+        }
+
+        if (!drmdev) {
+            dev = devices[i];
+            break;
+        }
+
+        const char* file = query_string(devices[i], EGL_DRM_DEVICE_FILE_EXT);
+        const char* node = strstr(exts, "EGL_EXT_device_drm_render_node") ?
+            query_string(devices[i], EGL_DRM_RENDER_NODE_FILE_EXT) : NULL;
+        if ((file && strcmp(file, drmdev) == 0) || (node && strcmp(node, drmdev) == 0)) {
+            dev = devices[i];
+            break;
+        }
+    }
+
+    if (!dev) {
+        return EGL_NO_DISPLAY;
+    }
+    return get_platform_display(EGL_PLATFORM_DEVICE_EXT, dev, NULL);
+}
+
+// Mesa picks a render node itself and falls back to software rendering
+static EGLDisplay surfaceless_display(const char* client_exts)
+{
+    if (!get_platform_display || !strstr(client_exts, "EGL_MESA_platform_surfaceless")) {
+        return EGL_NO_DISPLAY;
+    }
+    return get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+}
+
+/*
+ * every pass renders into FBOs, so the context is made current without any
+ * surface. auto tries the backends that need no privileged device first;
+ * with -d the surfaceless platform is skipped since it can't be pointed at
+ * a device.
+ */
+static void setup_context()
+{
+    const char* client_exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (!client_exts) client_exts = "";
+    get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+    static const int order[] = { BACKEND_DEVICE, BACKEND_SURFACELESS, BACKEND_GBM };
+    EGLint major;
+    EGLint minor;
+    ctx.display = EGL_NO_DISPLAY;
+    for (int i = 0; i < 3 && ctx.display == EGL_NO_DISPLAY; i++) {
+        int b = backend == BACKEND_AUTO ? order[i] : backend;
+        EGLDisplay dpy = EGL_NO_DISPLAY;
+        switch (b) {
+            case BACKEND_DEVICE: dpy = device_display(client_exts); break;
+            case BACKEND_SURFACELESS:
+                if (backend != BACKEND_AUTO || !drmdev) dpy = surfaceless_display(client_exts);
+                break;
+            case BACKEND_GBM: dpy = gbm_display(); break;
+        }
+
+        if (dpy != EGL_NO_DISPLAY && eglInitialize(dpy, &major, &minor)) {
+            ctx.display = dpy;
+            fprintf(stderr, "EGL %d.%d, %s backend\n", major, minor, backend_names[b]);
+        }
+
+        if (backend != BACKEND_AUTO) break;
+    }
+
+    if (ctx.display == EGL_NO_DISPLAY) {
+        err_quit("no EGL display for %s backend\n", backend_names[backend]);
+    }
+
+    const char *extensions = eglQueryString(ctx.display, EGL_EXTENSIONS);
+    if (!strstr(extensions, "EGL_KHR_surfaceless_context")) {
+        err_quit("%s\n", "need EGL_KHR_surfaceless_context extension");
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_ES_API)) {
         std::cerr << "bind api failed" << std::endl;
         exit(-1);
     }
 
-    static const EGLint conf_att[] = {
-        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
-        EGL_RED_SIZE, 8,
-        EGL_GREEN_SIZE, 8,
-        EGL_BLUE_SIZE, 8,
-        EGL_ALPHA_SIZE, 8,
-        EGL_NONE,
-    };
-    static const EGLint ctx_att[] = {
-        EGL_CONTEXT_CLIENT_VERSION, 3,
-        EGL_NONE
-    };
+    // no surface will be created, any surface type does
+    static const EGLint conf_att[] = {
+        EGL_SURFACE_TYPE, 0,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_NONE,
+    };
+    static const EGLint ctx_att[] = {
+        EGL_CONTEXT_CLIENT_VERSION, 3,
+        EGL_NONE
+    };
+
+    EGLConfig conf;
+    int num_conf;
+    EGLBoolean ret = eglChooseConfig(ctx.display, conf_att, &conf, 1, &num_conf);
+    if (!ret || num_conf != 1) {
+        printf("cannot find a proper EGL framebuffer configuration");
+        exit(-1);
+    }
+
+    ctx.gl_context = eglCreateContext(ctx.display, conf, EGL_NO_CONTEXT, ctx_att);
+    if (ctx.gl_context == EGL_NO_CONTEXT) {
+        printf("no context created.\n"); exit(0);
+    }
+
+    if (!eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx.gl_context)) {
+        printf("cannot activate EGL context");
+        exit(-1);
+    }
+    if (trace_path) {
+        trace_gpu_init();
+    }
+}
+
+static void cleanup()
+{
+    trace_gpu_collect(true);
+    pool_clear();
+    eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(ctx.display, ctx.gl_context);
+    eglTerminate(ctx.display);
+
+    if (ctx.gbm) {
+        gbm_device_destroy(ctx.gbm);
+        close(ctx.fd);
+    }
+}
+
+static void parse_backend(const char* name)
+{
+    for (int i = 0; i < BACKEND_COUNT; i++) {
+        if (strcmp(name, backend_names[i]) == 0) {
+            backend = i;
+            return;
+        }
+    }
+    err_quit("unknown backend %s\n", name);
+}
+
+static void parse_stream_format(const char* spec)
+{
+    char fmt[16] = {0};
+    int w = 0, h = 0;
+    sscanf(spec, "%15[^:]:%dx%d", fmt, &w, &h);
+    if (strcmp(fmt, "rgba") == 0) streamFormat = STREAM_RGBA;
+    else if (strcmp(fmt, "bgra") == 0) streamFormat = STREAM_BGRA;
+    else if (strcmp(fmt, "y4m") == 0) streamFormat = STREAM_Y4M;
+    else err_quit("unknown stream format %s\n", spec);
+
+    ctx.width = w;
+    ctx.height = h;
+}
+
+static int stream_main()
+{
+    int in_fd = 0, out_fd;
+    if (infile && strcmp(infile, "-") != 0) {
+        in_fd = open(infile, O_RDONLY|O_CLOEXEC);
+        if (in_fd < 0) err_quit("%s: %s\n", infile, strerror(errno));
+    }
+
+    if (outfile && strcmp(outfile, "-") != 0) {
+        out_fd = open(outfile, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+        if (out_fd < 0) err_quit("%s: %s\n", outfile, strerror(errno));
+    } else {
+        // frames own stdout, all diagnostics go to stderr
+        out_fd = dup(1);
+        dup2(2, 1);
+    }
+
+    if (streamFormat == STREAM_Y4M) {
+        string header;
+        if (!read_line(in_fd, header) || header.compare(0, 10, "YUV4MPEG2 ") != 0) {
+            err_quit("not a y4m stream\n");
+        }
+
+        size_t pos = 9;
+        while (pos != string::npos) {
+            size_t end = header.find(' ', pos+1);
+            string tok = header.substr(pos+1, end == string::npos ? string::npos : end-pos-1);
+            if (tok[0] == 'W') ctx.width = atoi(tok.c_str()+1);
+            else if (tok[0] == 'H') ctx.height = atoi(tok.c_str()+1);
+            else if (tok[0] == 'C' && tok.compare(1, 3, "420") != 0) {
+                err_quit("only 4:2:0 y4m streams are supported\n");
+            }
+            pos = end;
+        }
+
+        header += '\n';
+        write_full(out_fd, header.data(), header.size());
+    }
+
+    if (ctx.width <= 0 || ctx.height <= 0) {
+        err_quit("stream frame size is missing\n");
+    }
+
+    ctx.img_path = strdup("stream");
+    ctx.ncomp = 4;
+    ctx.tex_width = max(1, (int)(ctx.width * downscale));
+    ctx.tex_height = max(1, (int)(ctx.height * downscale));
+
+    cerr << "stream " << ctx.width << "x" << ctx.height << ", r: " << radius
+        << ", p: " << rounds << endl;
+
+    setup_context();
+    gl_init();
+    stream_frames(in_fd, out_fd);
+    cleanup();
+
+    close(out_fd);
+    return 0;
+}
+
+static void clamp_params()
+{
+    radius = max(min(radius, 49), 3);
+    radius = ((radius >> 1) << 1) + 1;
+    downscale = clamp_downscale(downscale);
+
+    if (adjustHSL) {
+        lightness = fmaxf(0.0, fminf(255.0, lightness));
+        saturation = fmaxf(0.0, fminf(255.0, saturation));
+    }
+}
+
+/*
+ * -O: several outputs from one decode, upload and downsample. outputs that
+ * share kernel and HSL constants form a chain ordered by passes, so a
+ * heavier blur continues from the rounds a lighter one already ran.
+ */
+struct output_spec {
+    string path;
+    GLint radius;
+    int rounds;
+    GLfloat sigma, lightness, saturation;
+    bool adjustHSL, adjustBrightness;
+    int width, height; // 0 keeps the aspect of the source
+};
+
+static vector<string> output_args;
+static vector<output_spec> outputs;
+
+static void use_output_params(const output_spec& out)
+{
+    radius = out.radius;
+    rounds = out.rounds;
+    sigma = out.sigma;
+    lightness = out.lightness;
+    saturation = out.saturation;
+    adjustHSL = out.adjustHSL;
+    adjustBrightness = out.adjustBrightness;
+}
+
+// "r=29,p=2,l=0.8,b,w=320,o=path", o comes last and takes the rest; other
+// keys default to the command line options
+static void parse_outputs()
+{
+    const output_spec defaults = { "", radius, rounds, sigma, lightness, saturation,
+        adjustHSL, adjustBrightness, 0, 0 };
+    for (auto& arg: output_args) {
+        output_spec out = defaults;
+
+        size_t at = arg.compare(0, 2, "o=") == 0 ? 0 : arg.find(",o=");
+        if (at == string::npos) {
+            err_quit("output %s has no path\n", arg.c_str());
+        }
+        out.path = arg.substr(at == 0 ? 2 : at + 3);
+
+        char* spec = strdup(arg.substr(0, at).c_str());
+        char* save = NULL;
+        for (char* kv = strtok_r(spec, ",", &save); kv; kv = strtok_r(NULL, ",", &save)) {
+            char* val = strchr(kv, '=');
+            if (val) *val++ = 0;
+
+            if (strcmp(kv, "b") == 0) out.adjustBrightness = true;
+            else if (!val) err_quit("output key %s needs a value\n", kv);
+            else if (strcmp(kv, "r") == 0) out.radius = atoi(val);
+            else if (strcmp(kv, "p") == 0) out.rounds = atoi(val);
+            else if (strcmp(kv, "S") == 0) out.sigma = atof(val);
+            else if (strcmp(kv, "l") == 0) { out.adjustHSL = true; out.lightness = atof(val); }
+            else if (strcmp(kv, "s") == 0) { out.adjustHSL = true; out.saturation = atof(val); }
+            else if (strcmp(kv, "w") == 0) out.width = atoi(val);
+            else if (strcmp(kv, "h") == 0) out.height = atoi(val);
+            else err_quit("unknown output key %s\n", kv);
+        }
+        free(spec);
+
+        use_output_params(out);
+        clamp_params();
+        output_spec clamped = { out.path, radius, rounds, sigma, lightness, saturation,
+            adjustHSL, adjustBrightness, out.width, out.height };
+        outputs.push_back(clamped);
+    }
+    use_output_params(defaults);
+}
+
+static bool same_chain(const output_spec& a, const output_spec& b)
+{
+    return a.radius == b.radius && a.sigma == b.sigma && a.adjustHSL == b.adjustHSL &&
+        (!a.adjustHSL || (a.lightness == b.lightness && a.saturation == b.saturation));
+}
+
+static void render_outputs()
+{
+    vector<output_spec*> order;
+    for (auto& out: outputs) {
+        if (out.width <= 0 && out.height <= 0) {
+            out.width = ctx.width;
+            out.height = ctx.height;
+        } else if (out.width <= 0) {
+            out.width = max(1, out.height * ctx.width / ctx.height);
+        } else if (out.height <= 0) {
+            out.height = max(1, out.width * ctx.height / ctx.width);
+        }
+        order.push_back(&out);
+    }
+
+    stable_sort(order.begin(), order.end(), [](const output_spec* a, const output_spec* b) {
+        if (a->radius != b->radius) return a->radius < b->radius;
+        if (a->sigma != b->sigma) return a->sigma < b->sigma;
+        if (a->adjustHSL != b->adjustHSL) return a->adjustHSL < b->adjustHSL;
+        if (a->adjustHSL && a->lightness != b->lightness) return a->lightness < b->lightness;
+        if (a->adjustHSL && a->saturation != b->saturation) return a->saturation < b->saturation;
+        return a->rounds < b->rounds;
+    });
+
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+    glDisable(GL_DEPTH_TEST);
+    trace_gpu(NULL);
+    downsample_source();
+
+    vector<thread> encoders;
+    const output_spec* chain = NULL;
+    int done = 0, chains = 0; // rounds already in fbTex[1] for the chain
+    for (auto out: order) {
+        use_output_params(*out);
+        bool new_chain = !chain || !same_chain(*chain, *out);
+        if (new_chain) {
+            build_kernel();
+        }
+
+        // brightness programs may be needed by any output of a chain
+        build_programs();
+        finish_programs();
+
+        if (new_chain) {
+            setup_ubo();
+
+            glViewport(0, 0, ctx.tex_width, ctx.tex_height);
+            if (adjustHSL) {
+                adjust_hsl(ctx.downsampleTex);
+            }
+            chain = out;
+            done = 0;
+            chains++;
+        }
+
+        blur_rounds(done, rounds);
+        done = max(done, rounds);
+
+        // outputs of the same size share a pooled target one after another
+        GLuint fb = ctx.outFb, tex = 0;
+        if ((out->width != ctx.width || out->height != ctx.height) &&
+                !acquire_target(out->width, out->height, internal_format(ctx.ncomp), &tex, &fb)) {
+            err_quit("%s: target exceeds the -M ceiling\n", out->path.c_str());
+        }
+        draw_output(fb, out->width, out->height);
+
+        if (!write_mapped_image(out->path, out->width, out->height)) {
+            int n = output_components(out->path);
+            char* data = (char*)malloc(out->width * out->height * n);
+            read_pixels(data, out->width, out->height, n);
+
+            // encoding runs while the GPU renders the next output
+            int w = out->width, h = out->height;
+            string path = out->path;
+            encoders.push_back(thread([=]() {
+                trace_thread("encoder");
+                save_image(data, w, h, n, path);
+                free(data);
+            }));
+        }
+
+        if (tex) {
+            release_target(&tex, &fb);
+        }
+    }
+    stage_done("render");
+
+    for (auto& t: encoders) {
+        t.join();
+    }
+    stage_done("encode");
+    cerr << outputs.size() << " outputs from " << chains << " chains" << endl;
+}
+
+// daemon mode: this thread owns the context and serves the requests
+// blur_daemon.cc queues from its connection threads
+static const char* daemon_path = NULL;
+
+static void dma_buf_sync(int fd, uint64_t flags)
+{
+    // memfds are not dma-bufs, ENOTTY is expected for them
+    struct dma_buf_sync sync = { flags };
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+static int process_request(const struct blur_request& req, int src_fd,
+        struct blur_response* resp, int* out_fd)
+{
+    int ncomp = req.format == BLUR_FORMAT_RGB888 ? 3 : 4;
+    if (req.format > BLUR_FORMAT_RGB888 || req.width == 0 || req.height == 0 ||
+            req.width > 16384 || req.height > 16384 ||
+            req.stride < req.width * ncomp || req.stride % ncomp) {
+        return -EINVAL;
+    }
+
+    size_t src_sz = (size_t)req.stride * req.height;
+    struct stat st;
+    if (fstat(src_fd, &st) < 0) return -errno;
+    if ((size_t)st.st_size < src_sz) {
+        // dma-bufs report no size through fstat
+        off_t end = lseek(src_fd, 0, SEEK_END);
+        if (end < 0 || (size_t)end < src_sz) return -EINVAL;
+    }
+
+    if ((req.flags & BLUR_FLAG_DMABUF) && !ctx.gbm) return -EOPNOTSUPP;
+
+    void* src = mmap(NULL, src_sz, PROT_READ, MAP_SHARED, src_fd, 0);
+    if (src == MAP_FAILED) return -errno;
+
+    // the result is drawn straight into the dma-buf, no memfd is needed
+    bool dmabuf = req.flags & BLUR_FLAG_DMABUF;
+    size_t dst_sz = dmabuf ? 0 : (size_t)req.width * req.height * 4;
+    int fd = dmabuf ? -1 : memfd_create("blurred", MFD_CLOEXEC);
+    if (!dmabuf && (fd < 0 || ftruncate(fd, dst_sz) < 0)) {
+        int err = errno;
+        if (fd >= 0) close(fd);
+        munmap(src, src_sz);
+        return -err;
+    }
+    void* dst = dmabuf ? NULL : mmap(NULL, dst_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (dst == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        munmap(src, src_sz);
+        return -err;
+    }
+
+    radius = req.radius;
+    rounds = max(1, min(req.passes, 64));
+    sigma = req.sigma > 0.0f ? req.sigma : 1.0f;
+    adjustBrightness = req.flags & BLUR_FLAG_BRIGHTNESS;
+    lightness = req.lightness;
+    saturation = req.saturation;
+    adjustHSL = lightness != 1.0f || saturation != 1.0f;
+    clamp_params();
+
+    // targets of sizes seen in the last few requests stay in the pool
+    pool_next_image();
+    if ((int)req.width != ctx.width || (int)req.height != ctx.height || ncomp != ctx.ncomp) {
+        if (ctx.tex) free_targets();
+        ctx.width = req.width;
+        ctx.height = req.height;
+        ctx.ncomp = ncomp;
+        ctx.tex_width = max(1, (int)(ctx.width * downscale));
+        ctx.tex_height = max(1, (int)(ctx.height * downscale));
+        if (!alloc_targets(true)) {
+            ctx.width = 0;
+            if (dst) {
+                munmap(dst, dst_sz);
+                close(fd);
+            }
+            munmap(src, src_sz);
+            return -ENOMEM;
+        }
+    }
+
+    build_kernel();
+    build_programs();
+    finish_programs();
+
+    dma_buf_sync(src_fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    ctx.img_data = (unsigned char*)src;
+    ctx.stride = req.stride;
+    upload_source();
+    dma_buf_sync(src_fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+    setup_ubo();
+    resp->format = BLUR_FORMAT_RGBA8888;
+    resp->width = req.width;
+    resp->height = req.height;
+    resp->fourcc = GBM_FORMAT_ABGR8888;
+
+    if (dmabuf) {
+        // a buffer object per request, the client owns it once the fd is sent
+        bo_target t;
+        bool ok = alloc_bo_target(t, ctx.width, ctx.height, 0);
+        if (ok) {
+            render_passes(t.fb);
+            glFinish();
+            resp->stride = gbm_bo_get_stride(t.bo);
+            resp->offset = gbm_bo_get_offset(t.bo, 0);
+            resp->modifier = gbm_bo_get_modifier(t.bo);
+            resp->size = resp->offset + resp->stride * req.height;
+            *out_fd = dup(t.fd);
+            free_bo_target(t);
+        }
+        ctx.img_data = NULL;
+        munmap(src, src_sz);
+        return ok && *out_fd >= 0 ? 0 : -ENOMEM;
+    }
+
+    render_passes(ctx.outFb);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.outFb);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, ctx.width, ctx.height, GL_RGBA, GL_UNSIGNED_BYTE, dst);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    ctx.img_data = NULL;
+    munmap(dst, dst_sz);
+    munmap(src, src_sz);
+
+    resp->stride = req.width * 4;
+    resp->size = dst_sz;
+    *out_fd = fd;
+    return 0;
+}
+
+static int daemon_main()
+{
+    int listen_fd = blur_daemon_listen(daemon_path);
+
+    // targets are allocated by the first request
+    setup_context();
+    gl_init();
+
+    cerr << "listening on " << daemon_path << endl;
+    blur_daemon_start(listen_fd);
+
+    for (;;) {
+        blur_job job = blur_daemon_next();
+
+        double started = now_ms();
+        struct blur_response resp;
+        memset(&resp, 0, sizeof resp);
+        resp.magic = BLUR_PROTO_MAGIC;
+        resp.id = job.req.id;
+
+        int out_fd = -1;
+        resp.status = process_request(job.req, job.fd, &resp, &out_fd);
+        blur_daemon_reply(job, resp, out_fd);
+        if (out_fd >= 0) close(out_fd);
+
+        fprintf(stderr, "request %llu: %ux%u prio %d, status %d, queued %.2f ms, blur %.2f ms, "
+                "targets %.1f MiB\n", (unsigned long long)job.req.id, job.req.width,
+                job.req.height, job.req.priority, resp.status, started - job.queued,
+                now_ms() - started, pool.bytes / 1048576.0);
+    }
+
+    return 0;
+}
+
+// runs on its own thread while the context is created and programs compile
+static GdkPixbuf* pixbuf = NULL;
+
+// pixels of path into ctx, mapped or through the codecs; false leaves
+// ctx.img_data NULL
+static bool load_image(const char* path)
+{
+    if (map_image(path)) {
+        return true;
+    }
+
+    GError *error = NULL;
+    pixbuf = gdk_pixbuf_new_from_file(path, &error);
+    if (!pixbuf) {
+        g_clear_error(&error);
+        ctx.img_data = NULL;
+        return false;
+    }
+    ctx.img_data = gdk_pixbuf_get_pixels(pixbuf);
+    ctx.ncomp = gdk_pixbuf_get_n_channels(pixbuf);
+    ctx.stride = gdk_pixbuf_get_rowstride(pixbuf);
+    ctx.width = gdk_pixbuf_get_width(pixbuf);
+    ctx.height = gdk_pixbuf_get_height(pixbuf);
+    return true;
+}
+
+static void unload_image()
+{
+    if (ctx.img_map) munmap(ctx.img_map, ctx.img_map_size);
+    if (pixbuf) g_object_unref(pixbuf);
+    ctx.img_map = NULL;
+    ctx.img_data = NULL;
+    pixbuf = NULL;
+}
+
+/*
+ * -Q: a preview at most PREVIEW_SIZE pixels across, blurred on the CPU with
+ * the sigma scaled down to its size, comes out before the full size image is
+ * decoded; codecs that can decode at a reduced size (JPEG by DCT scaling)
+ * do so. it runs while the main thread creates the context. a path gets the
+ * preview renamed into place, fd:N a PAM stream closed once it is complete,
+ * either is the signal that the preview is ready.
+ */
+#define PREVIEW_SIZE 320
+
+static void write_preview(const unsigned char* rgba, int w, int h, int ncomp)
+{
+    string path = preview_path;
+    if (path.compare(0, 3, "fd:") == 0) {
+        int fd = atoi(path.c_str() + 3);
+        char header[128];
+        int hlen = snprintf(header, sizeof header,
+                "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                w, h, ncomp, ncomp == 4 ? "RGB_ALPHA" : "RGB");
+        vector<unsigned char> data((size_t)w * h * ncomp);
+        pack_pixels(data.data(), rgba, w, h, ncomp);
+        if (!write_full(fd, header, hlen) || !write_full(fd, data.data(), data.size())) {
+            fprintf(stderr, "preview: %s\n", strerror(errno));
+        }
+        close(fd);
+        return;
+    }
+
+    // the decoder thread owns ctx until it is joined, output_components()
+    // reads the preview's channels from it
+    ctx.ncomp = ncomp;
+    size_t slash = path.find_last_of('/');
+    string tmp = path.substr(0, slash + 1) + ".tmp." + path.substr(slash + 1);
+    if (!write_mapped_image(tmp, w, h, rgba)) {
+        int n = output_components(tmp);
+        vector<unsigned char> data((size_t)w * h * n);
+        pack_pixels(data.data(), rgba, w, h, n);
+        save_image((char*)data.data(), w, h, n, tmp);
+    }
+    if (rename(tmp.c_str(), path.c_str()) < 0) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+    }
+}
+
+static void make_preview()
+{
+    // uncompressed inputs are mapped here already for the full decode
+    int full_w, full_h;
+    GdkPixbuf* reduced = NULL;
+    if (map_image(infile)) {
+        full_w = ctx.width;
+        full_h = ctx.height;
+    } else {
+        if (!gdk_pixbuf_get_file_info(infile, &full_w, &full_h)) {
+            return;
+        }
+        reduced = gdk_pixbuf_new_from_file_at_size(infile, min(full_w, PREVIEW_SIZE),
+                min(full_h, PREVIEW_SIZE), NULL);
+        if (!reduced) {
+            return;
+        }
+    }
+
+    const unsigned char* src = reduced ? gdk_pixbuf_get_pixels(reduced) : ctx.img_data;
+    int stride = reduced ? gdk_pixbuf_get_rowstride(reduced) : ctx.stride;
+    int ncomp = reduced ? gdk_pixbuf_get_n_channels(reduced) : ctx.ncomp;
+    int w = reduced ? gdk_pixbuf_get_width(reduced) : ctx.width;
+    int h = reduced ? gdk_pixbuf_get_height(reduced) : ctx.height;
+
+    // whatever the codec left above the preview size is averaged away
+    int f = (max(w, h) + PREVIEW_SIZE - 1) / PREVIEW_SIZE;
+    int pw = (w + f - 1) / f, ph = (h + f - 1) / f;
+    vector<unsigned char> small((size_t)pw * ph * 4), result(small.size());
+    reduce_image(src, stride, ncomp, w, h, f, small.data());
+    if (reduced) g_object_unref(reduced);
+
+    if (adjustHSL) {
+        cpu_adjust_hsl(small.data(), pw, ph, 4, lightness, saturation);
+    }
+    float s = (gaussSigma > 0 ? gaussSigma : target_sigma()) * pw / full_w;
+    iir_gaussian_blur(small.data(), pw * 4, pw, ph, 4, s, result.data());
+    if (adjustBrightness && cpu_brightness(result.data(), pw, ph, 4) > 100) {
+        cpu_darken(result.data(), pw, ph, 4);
+    }
+    write_preview(result.data(), pw, ph, ncomp);
+}
+
+/*
+ * compressed inputs without -Q are decoded by a GdkPixbufLoader fed from the
+ * file on the decoding thread. the main thread uploads the rows it reports
+ * done in strips of STRIP_ROWS through a ring of STRIP_RING pixel unpack
+ * buffers while decoding goes on, and on the default single output path
+ * reduces them into fb[1] and runs the first vertical blur pass over every
+ * row the uploaded ones cover, so what is left once the last row arrives is
+ * the last strip and the passes after. inputs whose decoders come back to
+ * rows they reported (progressive JPEG, interlaced PNG) are recognized by
+ * their header and only uploaded once they are done, other decoders caught
+ * doing so get the whole image uploaded again at the end. the pixbuf stays
+ * referenced by ingest until stream_upload() has seen the decode end.
+ */
+#define STRIP_ROWS 64
+#define STRIP_RING 4
+#define INGEST_CHUNK 65536
+
+static struct ingest_state {
+    mutex lock;
+    condition_variable cv;
+    GdkPixbuf* pixbuf; // ref of the loader's, from area-prepared
+    int rows; // rows from the top the decoder is done with
+    bool revisited; // rows may come again or out of order, only done counts
+    bool done;
+    bool ok; // decoded completely, pixbuf is handed over to the global one
+} ingest;
+
+// progressive JPEG (SOF2, 6, 10, 14) and Adam7 PNG are decoded in passes
+// over the whole image, so rows they report are not final
+static bool decodes_in_passes(const guchar* d, size_t len)
+{
+    static const guchar png[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (len > 28 && memcmp(d, png, sizeof png) == 0) {
+        return d[28] != 0; // interlace method of IHDR
+    }
+    if (len < 4 || d[0] != 0xff || d[1] != 0xd8) {
+        return false;
+    }
+    for (size_t i = 2; i + 4 <= len && d[i] == 0xff; ) {
+        guchar m = d[i + 1];
+        if (m == 0xff) {
+            i++;
+            continue;
+        }
+        if (m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc) {
+            return (m & 3) == 2;
+        }
+        i += 2 + (d[i + 2] << 8 | d[i + 3]);
+    }
+    return false;
+}
+
+static void ingest_prepared(GdkPixbufLoader* loader, gpointer)
+{
+    lock_guard<mutex> lk(ingest.lock);
+    ingest.pixbuf = (GdkPixbuf*)g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+    ingest.cv.notify_all();
+}
+
+static void ingest_updated(GdkPixbufLoader*, gint x, gint y, gint w, gint h, gpointer)
+{
+    lock_guard<mutex> lk(ingest.lock);
+    if (x != 0 || w != gdk_pixbuf_get_width(ingest.pixbuf) || y != ingest.rows) {
+        ingest.revisited = true;
+    } else if (!ingest.revisited) {
+        ingest.rows = y + h;
+        ingest.cv.notify_all();
+    }
+}
+
+// the decoding thread without -Q: maps uncompressed inputs like
+// load_image(), streams the others through the loader
+static void ingest_image()
+{
+    trace_thread("decoder");
+    double start = now_ms();
+    if (!map_image(infile)) {
+        GdkPixbufLoader* loader = gdk_pixbuf_loader_new();
+        g_signal_connect(loader, "area-prepared", G_CALLBACK(ingest_prepared), NULL);
+        g_signal_connect(loader, "area-updated", G_CALLBACK(ingest_updated), NULL);
+
+        int fd = open(infile, O_RDONLY | O_CLOEXEC);
+        vector<guchar> buf(INGEST_CHUNK);
+        ssize_t len = 0;
+        bool ok = fd >= 0, first = true;
+        while (ok && (len = read(fd, buf.data(), buf.size())) > 0) {
+            if (first && decodes_in_passes(buf.data(), len)) {
+                lock_guard<mutex> lk(ingest.lock);
+                ingest.revisited = true;
+            }
+            first = false;
+            ok = gdk_pixbuf_loader_write(loader, buf.data(), len, NULL);
+        }
+        if (fd >= 0) close(fd);
+        ok = gdk_pixbuf_loader_close(loader, NULL) && ok && len == 0;
+        g_object_unref(loader);
+
+        // a failed decode leaves the pixbuf to stream_upload(), which may
+        // still be copying rows from it
+        lock_guard<mutex> lk(ingest.lock);
+        if (ok && ingest.pixbuf) {
+            pixbuf = ingest.pixbuf;
+            ctx.img_data = gdk_pixbuf_get_pixels(pixbuf);
+            ctx.ncomp = gdk_pixbuf_get_n_channels(pixbuf);
+            ctx.stride = gdk_pixbuf_get_rowstride(pixbuf);
+            ctx.width = gdk_pixbuf_get_width(pixbuf);
+            ctx.height = gdk_pixbuf_get_height(pixbuf);
+            ingest.ok = true;
+        }
+    }
+
+    trace_span(ctx.img_map ? "map" : "decode", start);
+    lock_guard<mutex> lk(ingest.lock);
+    decode_ms = now_ms() - start;
+    ingest.done = true;
+    ingest.cv.notify_all();
+}
+
+// reduced rows the first y source rows cover, taps of vs_downsample included
+static int reduced_rows_of(int y)
+{
+    if (y >= ctx.height) return ctx.tex_height;
+    float ratio = (float)ctx.height / ctx.tex_height;
+    int n = (int)floorf((y - 1 - 0.25f / downscale) / ratio + 0.5f);
+    return max(0, min(ctx.tex_height, n));
+}
+
+// rows of the first vertical pass that read no reduced row past y
+static int vblur_rows_of(int y)
+{
+    if (y >= ctx.tex_height) return ctx.tex_height;
+    int reach = (int)ceilf(kernel[1 + (int)kernel[0] - 1]) + 1;
+    return max(0, y - reach);
+}
+
+// the part of the first passes the rows uploaded so far allow
+static void draw_ready_rows(int uploaded)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+    glDisable(GL_DEPTH_TEST);
+    glViewport(0, 0, ctx.tex_width, ctx.tex_height);
+
+    trace_gpu(NULL);
+    int reduced = reduced_rows_of(uploaded);
+    if (reduced > ctx.reduced_rows) {
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[1]);
+        glBindTexture(GL_TEXTURE_2D, ctx.tex);
+        scissor_rows(ctx.reduced_rows, reduced);
+        draw_fused(fx.downsample, 1.0f);
+        trace_gpu("downsample rows");
+        ctx.reduced_rows = reduced;
+    }
+
+    int blurred = rounds > 0 ? vblur_rows_of(ctx.reduced_rows) : 0;
+    if (blurred > ctx.vblur_rows) {
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[0]);
+        glBindTexture(GL_TEXTURE_2D, ctx.fbTex[1]);
+        glUseProgram(ctx.program);
+        scissor_rows(ctx.vblur_rows, blurred);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("vertical blur rows");
+        ctx.vblur_rows = blurred;
+    }
+    scissor_rows(0, ctx.tex_height);
+}
+
+// upload a compressed input as ingest_image() decodes it, with targets
+// allocated on the way. false when the input was mapped or did not decode,
+// main() then goes on as after load_image()
+static bool stream_upload()
+{
+    unique_lock<mutex> lk(ingest.lock);
+    ingest.cv.wait(lk, [] { return ingest.pixbuf || ingest.done; });
+    if (!ingest.pixbuf) {
+        return false;
+    }
+    GdkPixbuf* pb = ingest.pixbuf;
+    lk.unlock();
+    stage_done("wait");
+
+    ctx.width = gdk_pixbuf_get_width(pb);
+    ctx.height = gdk_pixbuf_get_height(pb);
+    ctx.ncomp = gdk_pixbuf_get_n_channels(pb);
+    ctx.tex_width = max(1, (int)(ctx.width * downscale));
+    ctx.tex_height = max(1, (int)(ctx.height * downscale));
+    alloc_targets();
+    glBindTexture(GL_TEXTURE_2D, ctx.tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format(ctx.ncomp), ctx.width, ctx.height, 0,
+            ctx.ncomp == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, NULL);
+
+    // the fused single output path only, -b ahead of the blur measures the
+    // whole source, a pyramid needs all of it, and -O, -A and CPU_ADJUST
+    // reduce it their own way
+    bool passes = outputs.empty() && autotuneBound <= 0 && !fx.probe[0] &&
+        downscale >= 0.25f;
+#ifdef CPU_ADJUST
+    passes = false;
+#endif
+    if (passes) {
+        finish_programs();
+        setup_ubo();
+    }
+
+    size_t row = (size_t)ctx.width * ctx.ncomp;
+    GLuint pbo[STRIP_RING];
+    glGenBuffers(STRIP_RING, pbo);
+    for (int i = 0; i < STRIP_RING; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, row * STRIP_ROWS, NULL, GL_STREAM_DRAW);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    const guchar* pixels = gdk_pixbuf_get_pixels(pb);
+    int stride = gdk_pixbuf_get_rowstride(pb);
+    int uploaded = 0, slot = 0, strips = 0, early_reduced = 0, early_blurred = 0;
+    for (;;) {
+        lk.lock();
+        ingest.cv.wait(lk, [&] {
+            return ingest.done || ingest.rows >= min(ctx.height, uploaded + STRIP_ROWS);
+        });
+        // no strip is taken, and none drawn, once rows may come again
+        int rows = ingest.revisited ? 0 : ingest.rows;
+        bool done = ingest.done;
+        lk.unlock();
+        if (!done) {
+            early_reduced = ctx.reduced_rows;
+            early_blurred = ctx.vblur_rows;
+        }
+
+        // a full strip, or the last one
+        while (rows - uploaded >= STRIP_ROWS || (rows == ctx.height && uploaded < rows)) {
+            double mark = trace_now();
+            int n = min(STRIP_ROWS, rows - uploaded);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[slot]);
+            unsigned char* dst = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                    row * n, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            for (int y = 0; y < n; y++) {
+                memcpy(dst + row * y, pixels + (size_t)stride * (uploaded + y), row);
+            }
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, uploaded, ctx.width, n,
+                    ctx.ncomp == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, 0);
+            uploaded += n;
+            slot = (slot + 1) % STRIP_RING;
+            strips++;
+            trace_span("strip", mark);
+            if (passes) {
+                draw_ready_rows(uploaded);
+                glBindTexture(GL_TEXTURE_2D, ctx.tex);
+            }
+        }
+        if (done) break;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(STRIP_RING, pbo);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    // the decode is over, the pixbuf is the global one or is dropped here
+    if (!ingest.ok) {
+        g_object_unref(ingest.pixbuf);
+        ingest.pixbuf = NULL;
+        return true;
+    }
+    // strips taken before a revisit showed may hold an earlier pass
+    if (ingest.revisited || uploaded < ctx.height) {
+        ctx.reduced_rows = ctx.vblur_rows = 0;
+        upload_source();
+    }
+    if (showStats) {
+        fprintf(stderr, "streamed %d of %d rows in %d strips, %d reduced and %d blurred rows "
+                "before the decode ended\n", uploaded, ctx.height, strips, early_reduced,
+                early_blurred);
+    }
+    return true;
+}
+
+static void decode_image()
+{
+    trace_thread("decoder");
+    double start = now_ms();
+    if (preview_path) {
+        make_preview();
+        preview_ms = now_ms() - start;
+        trace_span("preview", start);
+    }
+    double mark = trace_now();
+    if (!ctx.img_data) {
+        load_image(infile);
+    }
+    decode_ms = now_ms() - start;
+    trace_span(ctx.img_map ? "map" : "decode", mark);
+}
 
-    EGLConfig conf;
-    int num_conf;
-    EGLBoolean ret = eglChooseConfig(ctx.display, conf_att, &conf, 1, &num_conf);
-    if (!ret || num_conf != 1) {
-        printf("cannot find a proper EGL framebuffer configuration");
-        exit(-1);
+// the backends without a framebuffer hand over width x height RGBA rows
+static void write_result(const unsigned char* rgba)
+{
+    string path = output_path();
+    int n = output_components(path);
+    if (!write_mapped_image(path, ctx.width, ctx.height, rgba)) {
+        vector<unsigned char> data((size_t)ctx.width * ctx.height * n);
+        pack_pixels(data.data(), rgba, ctx.width, ctx.height, n);
+        save_image((char*)data.data(), ctx.width, ctx.height, n, path);
+    }
+}
+
+/*
+ * -B cpu: a recursive Gaussian of -G sigma (iir_blur.cc) on the full size
+ * image, its cost does not grow with sigma. without -G the sigma is the one
+ * -r, -S, -p and -x give on the GPU. -l and -s are applied before the blur,
+ * -b after it, both on full size pixels.
+ */
+static int cpu_main()
+{
+    if (!output_args.empty() || autotuneBound > 0) {
+        err_quit("-O and -A are not supported by the cpu backend\n");
     }
 
-    ctx.gl_context = eglCreateContext(ctx.display, conf, EGL_NO_CONTEXT, ctx_att);
-    if (ctx.gl_context == EGL_NO_CONTEXT) {
-        printf("no context created.\n"); exit(0);
+    stage_mark = now_ms();
+    ctx.img_path = strdup(infile);
+    decode_image();
+    stage_done("wait");
+    if (!ctx.img_data) {
+        err_quit("load %s failed\n", ctx.img_path);
     }
 
-    ctx.surface = eglCreateWindowSurface(ctx.display, conf, (EGLNativeWindowType)ctx.gbm_surface, NULL);
-    if (ctx.surface == EGL_NO_SURFACE) {
-        printf("cannot create EGL window surface");
-        exit(-1);
+    const unsigned char* src = ctx.img_data;
+    int stride = ctx.stride ? ctx.stride : ctx.width * ctx.ncomp;
+    vector<unsigned char> adjusted;
+    if (adjustHSL) {
+        adjusted.resize((size_t)ctx.width * ctx.height * ctx.ncomp);
+        for (int y = 0; y < ctx.height; y++) {
+            memcpy(&adjusted[(size_t)y * ctx.width * ctx.ncomp], src + (size_t)y * stride,
+                    ctx.width * ctx.ncomp);
+        }
+        cpu_adjust_hsl(adjusted.data(), ctx.width, ctx.height, ctx.ncomp, lightness, saturation);
+        src = adjusted.data();
+        stride = ctx.width * ctx.ncomp;
     }
 
-    if (!eglMakeCurrent(ctx.display, ctx.surface, ctx.surface, ctx.gl_context)) {
-        printf("cannot activate EGL context");
-        exit(-1);
+    float s = gaussSigma > 0 ? gaussSigma : target_sigma();
+    vector<unsigned char> result((size_t)ctx.width * ctx.height * 4);
+    iir_gaussian_blur(src, stride, ctx.width, ctx.height, ctx.ncomp, s, result.data());
+    if (adjustBrightness && cpu_brightness(result.data(), ctx.width, ctx.height, 4) > 100) {
+        cpu_darken(result.data(), ctx.width, ctx.height, 4);
+    }
+    stage_done("render");
+
+    write_result(result.data());
+    stage_done("write");
+
+    if (showStats) {
+        print_stats();
+        fprintf(stderr, "cpu sigma %g, %d threads, %s\n", s,
+                max(1u, thread::hardware_concurrency()), cpu_adjust_simd());
     }
+
+    unload_image();
+    free(infile);
+    free(outfile);
+    return 0;
 }
 
-static void cleanup()
+/*
+ * -W: watch directories with inotify and keep a blurred copy of every image
+ * in the -o directory, under the same name. a file is blurred once writes to
+ * it have settled for WATCH_SETTLE_MS, the context and programs stay up
+ * between files and an output replaces the old one only when it is
+ * complete. a state file in the output directory keeps a hash of every input
+ * and the parameters it was blurred with, so neither a restart nor a touch
+ * blurs anything again.
+ */
+#define WATCH_SETTLE_MS 100
+#define WATCH_STATE ".blur_image_watch"
+
+static vector<string> watch_dirs;
+
+struct watch_entry {
+    uint64_t hash;
+    string params;
+};
+
+// input path -> hash and parameters its output was made from
+static unordered_map<string, watch_entry> watch_state;
+
+static string watch_params()
 {
-    eglDestroySurface(ctx.display, ctx.surface);
-    eglDestroyContext(ctx.display, ctx.gl_context);
-    eglTerminate(ctx.display);
+    char buf[128];
+    snprintf(buf, sizeof buf, "r=%d p=%d S=%g x=%g l=%g s=%g b=%d t=%d", radius, rounds, sigma,
+            downscale, lightness, saturation, adjustBrightness, vertexTaps);
+    return effect_spec ? string(buf) + " E=" + effect_spec : string(buf);
+}
+
+// multiply and fold over whole words, enough to tell versions of a file apart
+static bool hash_file(const string& path, uint64_t* hash)
+{
+    int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    uint64_t h = 0xcbf29ce484222325ull ^ (uint64_t)st.st_size;
+    if (st.st_size > 0) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        const unsigned char* data = (const unsigned char*)p;
+        size_t words = st.st_size / 8;
+        for (size_t i = 0; i < words; i++) {
+            uint64_t w;
+            memcpy(&w, data + i * 8, 8);
+            h = (h ^ w) * 0x100000001b3ull;
+            h ^= h >> 29;
+        }
+        for (size_t i = words * 8; i < (size_t)st.st_size; i++) {
+            h = (h ^ data[i]) * 0x100000001b3ull;
+        }
+        munmap(p, st.st_size);
+    }
+    close(fd);
+    *hash = h;
+    return true;
+}
+
+// one line per input: hash \t parameters \t path
+static void load_watch_state()
+{
+    FILE* fp = fopen((string(outfile) + "/" WATCH_STATE).c_str(), "r");
+    if (!fp) {
+        return;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof line, fp)) {
+        char* params = strchr(line, '\t');
+        char* path = params ? strchr(params + 1, '\t') : NULL;
+        if (!path) {
+            continue;
+        }
+        *params++ = 0;
+        *path++ = 0;
+        path[strcspn(path, "\n")] = 0;
+        watch_state[path] = watch_entry{ strtoull(line, NULL, 16), params };
+    }
+    fclose(fp);
+}
+
+static void save_watch_state()
+{
+    string path = string(outfile) + "/" WATCH_STATE;
+    string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", tmp.c_str(), strerror(errno));
+        return;
+    }
+    for (auto& it: watch_state) {
+        fprintf(fp, "%016llx\t%s\t%s\n", (unsigned long long)it.second.hash,
+                it.second.params.c_str(), it.first.c_str());
+    }
+    if (fclose(fp) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    }
+}
+
+static string watch_output(const string& input)
+{
+    return string(outfile) + "/" + input.substr(input.find_last_of('/') + 1);
+}
+
+// blur input into the output directory unless its output is up to date
+static void watch_update(const string& input)
+{
+    double start = now_ms();
+    uint64_t hash = 0;
+    if (!hash_file(input, &hash)) {
+        return;
+    }
+
+    string out = watch_output(input), params = watch_params();
+    auto it = watch_state.find(input);
+    if (it != watch_state.end() && it->second.hash == hash && it->second.params == params &&
+            access(out.c_str(), F_OK) == 0) {
+        if (showStats) {
+            fprintf(stderr, "%s: unchanged\n", input.c_str());
+        }
+        return;
+    }
+
+    if (!load_image(input.c_str())) {
+        fprintf(stderr, "load %s failed\n", input.c_str());
+        return;
+    }
+    double loaded = now_ms();
+
+    // most wallpapers share a size, targets are only replaced when it changes
+    // and those of the other sizes wait in the pool
+    pool_next_image();
+    static int target_w = 0, target_h = 0, target_n = 0;
+    if (ctx.width != target_w || ctx.height != target_h || ctx.ncomp != target_n) {
+        if (target_w) free_targets();
+        ctx.tex_width = max(1, (int)(ctx.width * downscale));
+        ctx.tex_height = max(1, (int)(ctx.height * downscale));
+        alloc_targets();
+        target_w = ctx.width;
+        target_h = ctx.height;
+        target_n = ctx.ncomp;
+    }
+
+    upload_source();
+    setup_ubo();
+    render_passes(ctx.outFb);
+
+    // the hidden name keeps the suffix that picks the format, rename() swaps
+    // the finished file in
+    string tmp = string(outfile) + "/.tmp." + out.substr(out.find_last_of('/') + 1);
+    if (!write_mapped_image(tmp, ctx.width, ctx.height)) {
+        int n = output_components(tmp);
+        vector<char> data((size_t)ctx.width * ctx.height * n);
+        read_pixels(data.data(), ctx.width, ctx.height, n);
+        save_image(data.data(), ctx.width, ctx.height, n, tmp);
+    }
+    if (rename(tmp.c_str(), out.c_str()) < 0) {
+        fprintf(stderr, "%s: %s\n", out.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+    } else {
+        watch_state[input] = watch_entry{ hash, params };
+        save_watch_state();
+    }
+
+    fprintf(stderr, "%s: %dx%d, load %.2f ms, blur and write %.2f ms\n", input.c_str(),
+            ctx.width, ctx.height, loaded - start, now_ms() - loaded);
+    unload_image();
+}
+
+static void watch_remove(const string& input)
+{
+    if (watch_state.erase(input)) {
+        unlink(watch_output(input).c_str());
+        save_watch_state();
+        fprintf(stderr, "%s: removed\n", input.c_str());
+    }
+}
+
+static int watch_main()
+{
+    if (!outfile || (mkdir(outfile, 0755) < 0 && errno != EEXIST)) {
+        err_quit("-W needs an output directory, -o dir\n");
+    }
+    if (!output_args.empty() || autotuneBound > 0) {
+        err_quit("-O and -A are not supported with -W\n");
+    }
+
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd < 0) err_quit("inotify: %s\n", strerror(errno));
+
+    // files are done when they are closed after writing or moved in, other
+    // writes only push the deadline back
+    unordered_map<int, string> wds;
+    char out_real[PATH_MAX];
+    if (!realpath(outfile, out_real)) err_quit("%s: %s\n", outfile, strerror(errno));
+    for (auto& dir: watch_dirs) {
+        char real[PATH_MAX];
+        if (!realpath(dir.c_str(), real)) err_quit("%s: %s\n", dir.c_str(), strerror(errno));
+        if (strcmp(real, out_real) == 0) err_quit("%s is the output directory\n", dir.c_str());
+        int wd = inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY |
+                IN_CREATE | IN_DELETE | IN_MOVED_FROM);
+        if (wd < 0) err_quit("%s: %s\n", dir.c_str(), strerror(errno));
+        wds[wd] = dir;
+    }
+
+    setup_context();
+    gl_init();
+    load_watch_state();
+
+    // inputs that went away while nobody was watching
+    vector<string> gone;
+    for (auto& it: watch_state) {
+        if (access(it.first.c_str(), F_OK) < 0) gone.push_back(it.first);
+    }
+    for (auto& input: gone) {
+        watch_remove(input);
+    }
+
+    // path -> time its writes have settled
+    unordered_map<string, double> pending;
+    for (auto& dir: watch_dirs) {
+        DIR* d = opendir(dir.c_str());
+        for (struct dirent* e; d && (e = readdir(d)); ) {
+            if (e->d_name[0] != '.') pending[dir + "/" + e->d_name] = 0;
+        }
+        if (d) closedir(d);
+    }
+
+    cerr << "watching " << watch_dirs.size() << " directories, output " << outfile << endl;
+
+    for (;;) {
+        double now = now_ms(), next = -1;
+        for (auto it = pending.begin(); it != pending.end(); ) {
+            if (it->second <= now) {
+                watch_update(it->first);
+                it = pending.erase(it);
+                now = now_ms();
+            } else {
+                next = next < 0 ? it->second : min(next, it->second);
+                ++it;
+            }
+        }
+
+        // nothing pending is a poll without timeout, an idle watch costs nothing
+        struct pollfd pfd = { ifd, POLLIN, 0 };
+        int timeout = next < 0 ? -1 : (int)ceil(next - now);
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            err_quit("poll: %s\n", strerror(errno));
+        }
+
+        char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(ifd, buf, sizeof buf)) > 0) {
+            for (char* p = buf; p < buf + len; ) {
+                struct inotify_event* ev = (struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if (!ev->len || ev->name[0] == '.' || (ev->mask & IN_ISDIR) || !wds.count(ev->wd)) {
+                    continue;
+                }
+
+                string path = wds[ev->wd] + "/" + ev->name;
+                if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    pending.erase(path);
+                    watch_remove(path);
+                } else {
+                    pending[path] = now_ms() + WATCH_SETTLE_MS;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * -I N: blur the input files into the -o directory, N to an atlas. small
+ * images cost little more than the fixed price of a pass and a readback, so
+ * an atlas takes the blur rounds and the readback once for all its images.
+ * every image is reduced into a cell of the tex size atlas with a gutter as
+ * wide as the blur reaches, drawn with texture coordinates past its edges so
+ * the gutter holds its clamped edge like the border of a texture of its own
+ * and neighbours do not bleed into it. the final draws scale the cells into
+ * a tightly packed full size atlas that is read back in one go and split
+ * into the outputs. -b darkens every image by its own brightness on the
+ * CPU; vignette and -E darken would see the whole atlas and are refused.
+ * -I 1 is the one-at-a-time path to compare with.
+ */
+struct batch_item {
+    string path;
+    int width, height, ncomp;
+    vector<unsigned char> pixels; // tightly packed
+    int x, y; // of the image in the full size atlas
+    int cell_x, cell_y; // of its cell in the tex size atlas, gutter included
+};
+
+struct batch_atlas {
+    int width, height, tex_width, tex_height, ncomp;
+    vector<int> items;
+    double reduce_ms, render_ms, write_ms; // -T
+};
+
+// tex size texels the blur reaches past an edge before what it gathers there
+// stays under a level, three standard deviations of all rounds plus the
+// sampling taps
+static int batch_gutter()
+{
+    int taps = (int)kernel[0];
+    float sum = kernel[51], var = 0;
+    for (int i = 1; i < taps; i++) {
+        sum += 2 * kernel[51+i];
+        var += 2 * kernel[51+i] * kernel[1+i] * kernel[1+i];
+    }
+    return (int)ceilf(3 * sqrtf(rounds * var / sum) + 2);
+}
+
+static int batch_tex_size(int n)
+{
+    return max(1, (int)ceilf(n * downscale));
+}
+
+// shelves of rects in the given order, rows about as wide as the total area
+// is square; false when they need more than max_size either way
+static bool pack_shelves(const vector<pair<int, int> >& rects, int max_size,
+        vector<pair<int, int> >& at, int* width, int* height)
+{
+    double area = 0;
+    int widest = 0;
+    for (auto& r: rects) {
+        area += (double)r.first * r.second;
+        widest = max(widest, r.first);
+    }
+
+    int row = min(max_size, max(widest, (int)ceil(sqrt(area))));
+    int x = 0, y = 0, shelf = 0;
+    *width = *height = 0;
+    at.clear();
+    for (auto& r: rects) {
+        if (x + r.first > row) {
+            x = 0;
+            y += shelf;
+            shelf = 0;
+        }
+        at.push_back(make_pair(x, y));
+        x += r.first;
+        shelf = max(shelf, r.second);
+        *width = max(*width, x);
+        *height = max(*height, y + shelf);
+    }
+    return widest <= max_size && *height <= max_size;
+}
+
+// images sorted by height, batchSize to an atlas or fewer when the cells or
+// the full size images do not fit a texture
+static vector<batch_atlas> pack_atlases(vector<batch_item>& items, int gutter, int max_size)
+{
+    vector<int> order(items.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return items[a].height > items[b].height;
+    });
+
+    vector<batch_atlas> atlases;
+    vector<pair<int, int> > cells, rects, cell_at, rect_at;
+    for (size_t i = 0; i < order.size(); ) {
+        size_t count = min(order.size() - i, (size_t)batchSize);
+        for (;;) {
+            cells.clear();
+            rects.clear();
+            for (size_t j = i; j < i + count; j++) {
+                const batch_item& it = items[order[j]];
+                cells.push_back(make_pair(batch_tex_size(it.width) + 2 * gutter,
+                            batch_tex_size(it.height) + 2 * gutter));
+                rects.push_back(make_pair(it.width, it.height));
+            }
+
+            batch_atlas atlas = { 0, 0, 0, 0, 3, {}, 0, 0, 0 };
+            if (pack_shelves(cells, max_size, cell_at, &atlas.tex_width, &atlas.tex_height) &&
+                    pack_shelves(rects, max_size, rect_at, &atlas.width, &atlas.height)) {
+                for (size_t j = 0; j < count; j++) {
+                    batch_item& it = items[order[i+j]];
+                    it.cell_x = cell_at[j].first;
+                    it.cell_y = cell_at[j].second;
+                    it.x = rect_at[j].first;
+                    it.y = rect_at[j].second;
+                    atlas.ncomp = max(atlas.ncomp, it.ncomp);
+                    atlas.items.push_back(order[i+j]);
+                }
+                atlases.push_back(atlas);
+                i += count;
+                break;
+            }
+            if (count == 1) {
+                err_quit("%s: %dx%d does not fit a %d texture\n", items[order[i]].path.c_str(),
+                        items[order[i]].width, items[order[i]].height, max_size);
+            }
+            count = (count + 1) / 2;
+        }
+    }
+    return atlases;
+}
+
+// all passes of one atlas, the full size result is left in outFb
+static void render_atlas(const batch_atlas& atlas, const vector<batch_item>& items, int gutter)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+    glDisable(GL_DEPTH_TEST);
+
+    // cells are reduced straight into the target the blur rounds start from
+    GLuint reduced_fb = ctx.fb[1], blurred = ctx.fbTex[1];
+#ifdef CPU_ADJUST
+    reduced_fb = ctx.downsampleFb;
+    blurred = ctx.downsampleTex;
+#endif
+    trace_gpu(NULL);
+    glBindFramebuffer(GL_FRAMEBUFFER, reduced_fb);
+    glClearColor(0, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (int idx: atlas.items) {
+        const batch_item& it = items[idx];
+        glBindTexture(GL_TEXTURE_2D, ctx.tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format(it.ncomp), it.width, it.height, 0,
+                it.ncomp == 4 ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, it.pixels.data());
+        if (downscale < 0.25f) {
+            quad_coords(0, 0, 1, 1);
+            glBindTexture(GL_TEXTURE_2D, reduced_source(it.width, it.height));
+            glBindFramebuffer(GL_FRAMEBUFFER, reduced_fb);
+        }
+
+        // the image spans width * downscale texels of its cell
+        int cw = batch_tex_size(it.width) + 2 * gutter;
+        int ch = batch_tex_size(it.height) + 2 * gutter;
+        float sw = it.width * downscale, sh = it.height * downscale;
+        glViewport(it.cell_x, it.cell_y, cw, ch);
+        quad_coords(-gutter / sw, -gutter / sh, (cw - gutter) / sw, (ch - gutter) / sh);
+#ifdef CPU_ADJUST
+        glUseProgram(ctx.programDownsample);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+#else
+        draw_fused(fx.downsample, 1.0f);
+#endif
+    }
+    trace_gpu("downsample");
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    quad_coords(0, 0, 1, 1);
+
+#ifdef CPU_ADJUST
+    if (adjustHSL) {
+        adjust_hsl(ctx.downsampleTex);
+        blurred = ctx.lgtTex;
+    }
+#endif
+
+    glViewport(0, 0, ctx.tex_width, ctx.tex_height);
+    for (int i = 0; i < rounds; i++) {
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[0]);
+        glBindTexture(GL_TEXTURE_2D, blurred);
+        glUseProgram(ctx.program);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("vertical blur");
+
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[1]);
+        glBindTexture(GL_TEXTURE_2D, ctx.fbTex[0]);
+        glUseProgram(ctx.programH);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        trace_gpu("horizontal blur");
+        blurred = ctx.fbTex[1];
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.outFb);
+    glBindTexture(GL_TEXTURE_2D, blurred);
+    for (int idx: atlas.items) {
+        const batch_item& it = items[idx];
+        float x = it.cell_x + gutter, y = it.cell_y + gutter;
+        glViewport(it.x, it.y, it.width, it.height);
+        quad_coords(x / ctx.tex_width, y / ctx.tex_height,
+                (x + it.width * downscale) / ctx.tex_width,
+                (y + it.height * downscale) / ctx.tex_height);
+#ifdef CPU_ADJUST
+        glUseProgram(ctx.programDirect);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+#else
+        draw_fused(fx.output, 1.0f);
+#endif
+    }
+    trace_gpu("output");
+    quad_coords(0, 0, 1, 1);
+}
+
+static int batch_main(int argc, char* argv[])
+{
+    if (!outfile || (mkdir(outfile, 0755) < 0 && errno != EEXIST)) {
+        err_quit("-I needs an output directory, -o dir\n");
+    }
+    if (!output_args.empty() || autotuneBound > 0 || zeroCopy || preview_path ||
+            streamFormat != STREAM_NONE || daemon_path || !watch_dirs.empty() ||
+            backend == BACKEND_CPU) {
+        err_quit("-I takes one -o directory of an EGL backend, without -O, -A, -Z, -Q, -F, -D "
+                "and -W\n");
+    }
+    for (auto& st: effects) {
+        if (st.kind == FX_DARKEN || st.kind == FX_VIGNETTE) {
+            err_quit("-I: %s would see the whole atlas\n", fx_names[st.kind]);
+        }
+    }
+
+    double start = now_ms();
+    vector<batch_item> items;
+    for (int i = optind; i < argc; i++) {
+        if (!load_image(argv[i])) {
+            fprintf(stderr, "load %s failed\n", argv[i]);
+            continue;
+        }
+        batch_item it = { argv[i], ctx.width, ctx.height, ctx.ncomp, {}, 0, 0, 0, 0 };
+        size_t row = (size_t)ctx.width * ctx.ncomp;
+        it.pixels.resize(row * ctx.height);
+        for (int y = 0; y < ctx.height; y++) {
+            memcpy(&it.pixels[row * y], ctx.img_data + (ctx.stride ? ctx.stride : row) * y, row);
+        }
+        items.push_back(move(it));
+        unload_image();
+    }
+    if (items.empty()) {
+        return 1;
+    }
+    ctx.width = ctx.height = 0;
+
+    // -b is measured per image after the split
+    bool darken = adjustBrightness;
+    adjustBrightness = false;
+
+    trace_span("decode", start);
+    double ready = trace_now();
+    setup_context();
+    gl_init();
+    trace_span("context", ready);
+    double loaded = now_ms();
+
+    // an atlas of one needs no gutter, its texture edges clamp
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    int gutter = batchSize > 1 ? batch_gutter() : 0;
+    vector<batch_atlas> atlases = pack_atlases(items, gutter, max_size);
+
+    vector<unsigned char> result;
+    for (auto& atlas: atlases) {
+        double mark = now_ms();
+        ctx.width = atlas.width;
+        ctx.height = atlas.height;
+        ctx.tex_width = atlas.tex_width;
+        ctx.tex_height = atlas.tex_height;
+        ctx.ncomp = atlas.ncomp;
+        pool_next_image();
+        alloc_targets();
+        setup_ubo();
+        render_atlas(atlas, items, gutter);
+
+        double readback = trace_now();
+        result.resize((size_t)ctx.width * ctx.height * 4);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, ctx.width, ctx.height, GL_RGBA, GL_UNSIGNED_BYTE, result.data());
+        trace_span("readback", readback);
+        trace_gpu_collect(false);
+        free_targets();
+        atlas.render_ms = now_ms() - mark;
+        trace_span("atlas", mark);
+        mark = now_ms();
+
+        for (int idx: atlas.items) {
+            batch_item& it = items[idx];
+            vector<unsigned char> rgba((size_t)it.width * it.height * 4);
+            pack_pixels(rgba.data(), &result[((size_t)it.y * atlas.width + it.x) * 4],
+                    it.width, it.height, 4, atlas.width * 4);
+            if (darken && cpu_brightness(rgba.data(), it.width, it.height, 4) > 100) {
+                cpu_darken(rgba.data(), it.width, it.height, 4);
+            }
+
+            string path = watch_output(it.path);
+            ctx.ncomp = it.ncomp;
+            if (!write_mapped_image(path, it.width, it.height, rgba.data())) {
+                int n = output_components(path);
+                vector<unsigned char> data((size_t)it.width * it.height * n);
+                pack_pixels(data.data(), rgba.data(), it.width, it.height, n);
+                save_image((char*)data.data(), it.width, it.height, n, path);
+            }
+        }
+        atlas.write_ms = now_ms() - mark;
+        trace_span("write", mark);
+    }
+
+    double done = now_ms();
+    fprintf(stderr, "%zu images in %zu atlases (gutter %d), load %.2f ms, blur and write "
+            "%.2f ms, %.1f images/s\n", items.size(), atlases.size(), gutter, loaded - start,
+            done - loaded, items.size() * 1000.0 / (done - loaded));
+    if (showStats) {
+        for (auto& atlas: atlases) {
+            fprintf(stderr, "atlas %dx%d (%dx%d reduced), %zu images, passes and readback "
+                    "%.2f ms, write %.2f ms\n", atlas.width, atlas.height, atlas.tex_width,
+                    atlas.tex_height, atlas.items.size(), atlas.render_ms, atlas.write_ms);
+        }
+    }
+
+    free(outfile);
+    cleanup();
+    return 0;
 }
 
 static void usage()
@@ -885,23 +4586,60 @@ static void usage()
             "\t[-r radius] radius now should be odd number ranging [3-49]\n"
             "\t[-S sigma] sample distance (default 1.0)\n"
             "\t[-b] adjust brightness after blurring\n"
-            "\t[-d drmdev] use drmdev (/dev/dri/card0 e.g) to render\n"
+            "\t[-d drmdev] use drmdev (/dev/dri/renderD128 e.g) to render\n"
+            "\t[-B auto|gbm|surfaceless|device|cpu] EGL platform or recursive blur on the CPU\n"
+            "\t\t(default auto)\n"
             "\t[-l percent] multiple current lightness by percent [0.0-1.0] \n"
             "\t[-s percent] multiple current saturation by percent [0.0-1.0] \n"
-            "\t[-p rendering passes] iterate passes of rendering, raning [1-INF]\n");
+            "\t[-p rendering passes] iterate passes of rendering, raning [1-INF]\n"
+            "\t[-x factor] downscale factor of the blur passes [0.25-1.0], or 0.125 and 0.0625\n"
+            "\t\tthrough a pyramid of halvings (default 0.25)\n"
+            "\t[-G sigma] Gaussian sigma in image pixels, sets passes (-B cpu: blurs at it)\n"
+            "\t[-A psnr] time plans of the same blur, use and remember the fastest above psnr dB\n"
+            "\t[-P path|none] tuning profile (default $XDG_CONFIG_HOME/blur_image/profile)\n"
+            "\t[-Q path|fd:N] write a small preview of the blur there before the full result\n"
+            "\t[-O r=N,p=N,S=F,l=F,s=F,b,w=N,h=N,o=path] add an output, repeatable, replaces -o\n"
+            "\t[-t] compute tap coordinates in vertex stage with linear sampling\n"
+            "\t[-T] print time spent in every stage\n"
+            "\t[-J path] write a Chrome/Perfetto JSON trace of the threads and GPU draws\n"
+            "\t[-F rgba:WxH|bgra:WxH|y4m] stream raw frames from infile or stdin to outfile or stdout\n"
+            "\t[-E stage,...] effect chain of downscale=F, blur=N, scale, hsl=l:s, darken=F,\n"
+            "\t\tvignette=strength:radius, tint=r:g:b:amount; replaces -l, -s and -b\n"
+            "\t[-M MiB] ceiling of the pooled render targets (default none)\n"
+            "\t[-Z] render into a linear gbm buffer and write outfile from its mapping\n"
+            "\t[-D socket] serve blur requests on a unix socket, see blur_protocol.h\n"
+            "\t[-I N] blur all inputs into the -o directory, N images to a texture atlas\n"
+            "\t[-W dir] keep blurred copies of the images in dir in the -o directory, repeatable\n");
 }
 
 int main(int argc, char *argv[])
 {
     int ch;
-    while ((ch = getopt(argc, argv, "d:o:r:S:p:bl:s:h")) != -1) {
+    while ((ch = getopt(argc, argv, "d:o:O:r:S:p:x:G:A:P:Q:bl:s:tTJ:ZM:E:I:B:F:D:W:h")) != -1) {
         switch(ch) {
             case 'd': drmdev = strdup(optarg); break;
             case 'o': outfile = strdup(optarg); break;
-            case 'r': radius = atoi(optarg); break;
-            case 'S': sigma = atof(optarg); break;
-            case 'p': rounds = atoi(optarg); break;
+            case 'O': output_args.push_back(optarg); break;
+            case 'r': radius = atoi(optarg); givenParams |= GIVEN_RADIUS; break;
+            case 'S': sigma = atof(optarg); givenParams |= GIVEN_SIGMA; break;
+            case 'p': rounds = atoi(optarg); givenParams |= GIVEN_ROUNDS; break;
+            case 'x': downscale = atof(optarg); givenParams |= GIVEN_DOWNSCALE; break;
+            case 'G': gaussSigma = atof(optarg); break;
+            case 'A': autotuneBound = atof(optarg); break;
+            case 'P': profile_path = strdup(optarg); break;
+            case 'Q': preview_path = strdup(optarg); break;
             case 'b': adjustBrightness = true; break;
+            case 't': vertexTaps = true; givenParams |= GIVEN_TAPS; break;
+            case 'T': showStats = true; break;
+            case 'J': trace_path = strdup(optarg); break;
+            case 'Z': zeroCopy = true; break;
+            case 'M': poolCeiling = atof(optarg); break;
+            case 'E': effect_spec = strdup(optarg); break;
+            case 'I': batchSize = atoi(optarg); break;
+            case 'B': parse_backend(optarg); break;
+            case 'F': parse_stream_format(optarg); break;
+            case 'D': daemon_path = strdup(optarg); break;
+            case 'W': watch_dirs.push_back(optarg); break;
             case 'l': adjustHSL = true; lightness = (GLfloat)atof(optarg); break;
             case 's': adjustHSL = true; saturation = (GLfloat)atof(optarg); break;
             case 'h': 
@@ -909,49 +4647,128 @@ int main(int argc, char *argv[])
         }
     }
 
-    radius = max(min(radius, 49), 3);
-    radius = ((radius >> 1) << 1) + 1;
-
-    if (adjustHSL) {
-        lightness = fmaxf(0.0, fminf(255.0, lightness));
-        saturation = fmaxf(0.0, fminf(255.0, saturation));
+    clamp_params();
+    pool.ceiling = (size_t)(poolCeiling * 1048576);
+    if (trace_path) {
+        trace_thread("main");
+        atexit(trace_write);
     }
-
-#if defined(__alpha__) || defined(__sw_64__) || defined(__mips__)
-    adjustHSL = false; // force it
+    if (gaussSigma > 0) {
+        rounds = passes_for_sigma(gaussSigma, radius, sigma, downscale);
+        givenParams |= GIVEN_ROUNDS;
+    }
+    separatePasses = !output_args.empty();
+    if (effect_spec) {
+#ifdef CPU_ADJUST
+        err_quit("-E needs the GPU color passes, this build runs them on the CPU\n");
 #endif
+        if (adjustHSL || adjustBrightness || separatePasses || daemon_path ||
+                backend == BACKEND_CPU) {
+            err_quit("-E replaces -l, -s and -b and takes one output of an EGL backend\n");
+        }
+        parse_effects(effect_spec);
+    }
 
     if (optind < argc && !infile) {
         infile = strdup(argv[optind]);
     }
 
-    if (!infile || !outfile) {
+    if (backend == BACKEND_CPU &&
+            (streamFormat != STREAM_NONE || daemon_path || !watch_dirs.empty())) {
+        err_quit("-F, -D and -W need an EGL backend\n");
+    }
+
+    // buffer objects come from the gbm device
+    if (zeroCopy && backend == BACKEND_AUTO) {
+        backend = BACKEND_GBM;
+    }
+    if (zeroCopy && (backend != BACKEND_GBM || !output_args.empty())) {
+        err_quit("-Z needs the gbm backend and a single -o output\n");
+    }
+
+    if (batchSize > 0) {
+        if (optind >= argc) usage();
+        return batch_main(argc, argv);
+    }
+
+    if (streamFormat != STREAM_NONE) {
+        return stream_main();
+    }
+
+    if (daemon_path) {
+        return daemon_main();
+    }
+
+    if (!watch_dirs.empty()) {
+        return watch_main();
+    }
+
+    if (!infile || (!outfile && output_args.empty())) {
         usage();
     }
+    if (backend == BACKEND_CPU) {
+        return cpu_main();
+    }
+    parse_outputs();
 
-    cout << "outfile: " << outfile << ", infile: " << infile << ", r: " << radius
+    cout << "outfile: " << (outfile ? outfile : "-") << ", infile: " << infile << ", r: " << radius
         << ", p: " << rounds  << ", l: " << lightness << ", s: " << saturation << endl;
 
+    stage_mark = now_ms();
     ctx.img_path = strdup(infile);
-    GError *error = NULL;
-    GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file(infile, &error);
-    ctx.img_data = gdk_pixbuf_get_pixels(pixbuf);
-    ctx.ncomp = gdk_pixbuf_get_n_channels(pixbuf);
-    ctx.width = gdk_pixbuf_get_width(pixbuf);
-    ctx.height = gdk_pixbuf_get_height(pixbuf);
+    thread decoder(preview_path ? decode_image : ingest_image);
+
+    setup_context();
+    stage_done("context");
+
+    blur_plan plan;
+    if (outputs.empty() && autotuneBound <= 0 && load_profile(target_sigma(), plan) &&
+            merge_plan(plan, target_sigma())) {
+        fprintf(stderr, "profile plan -x %g -r %d -p %d -S %g%s\n", plan.downscale, plan.radius,
+                plan.rounds, plan.sigma, plan.taps ? " -t" : "");
+        use_plan(plan);
+    }
+    gl_init_programs();
+    stage_done("compile");
+#ifdef CPU_ADJUST
+    if (showStats && (adjustHSL || adjustBrightness)) {
+        fprintf(stderr, "HSL and brightness on the CPU (%s)\n", cpu_adjust_simd());
+    }
+#endif
+
+    // compressed inputs are uploaded while they decode
+    bool streamed = !preview_path && stream_upload();
+    decoder.join();
+    if (!streamed) stage_done("wait");
     cout << "image " << (ctx.ncomp == 4? "has": "has no") << " alpha" << endl;
     if (!ctx.img_data) {
         err_quit("load %s failed\n", ctx.img_path);
     }
 
-    ctx.tex_width = ctx.width * 0.25f;
-    ctx.tex_height = ctx.height * 0.25f;
+    if (!streamed) {
+        ctx.tex_width = max(1, (int)(ctx.width * downscale));
+        ctx.tex_height = max(1, (int)(ctx.height * downscale));
+        alloc_targets();
+        upload_source();
+    }
+    stage_done("upload");
+    finish_programs();
+    stage_done("link");
+    if (autotuneBound > 0 && outputs.empty()) {
+        autotune();
+        stage_done("tune");
+    }
+    if (!outputs.empty()) {
+        render_outputs();
+    } else {
+        render();
+    }
 
-    setup_context();
-    gl_init();
-    render();
+    if (showStats) {
+        print_stats();
+    }
 
-    g_object_unref (pixbuf);
+    unload_image();
     free(infile);
     free(outfile);
     cleanup();
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <mutex>
+
+#include "blur_client.h"
+
+using namespace std;
+
+#define err_quit(fmt, ...) do { \
+    fprintf(stderr, fmt, ## __VA_ARGS__); \
+    exit(-1); \
+} while (0)
+
+// load generator for blur_image -D: every client thread owns a connection
+// and keeps a number of requests in flight with random priorities
+
+static const char* sock_path = NULL;
+static int clients = 4, requests = 50, depth = 2;
+static int width = 1920, height = 1080;
+static int radius = 19, passes = 1;
+static bool dmabuf = false; // -z, ask for BLUR_FLAG_DMABUF results
+
+static mutex stats_lock;
+static vector<double> latencies;
+static int failures = 0;
+static bool layout_shown = false; // -z, of the first result
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// a flat source stays flat after blurring, which makes results checkable.
+// a dma-buf in a tiled layout can only be checked for its size
+static bool check_result(const struct blur_response& resp, int fd)
+{
+    if (resp.width != (uint32_t)width || resp.height != (uint32_t)height ||
+            resp.size < resp.offset + resp.stride * resp.height) {
+        return false;
+    }
+    if (resp.modifier != 0) {
+        return true;
+    }
+
+    unsigned char* px = (unsigned char*)mmap(NULL, resp.size, PROT_READ, MAP_SHARED, fd, 0);
+    if (px == MAP_FAILED) {
+        return false;
+    }
+
+    // memfds are not dma-bufs, ENOTTY is expected for them
+    struct dma_buf_sync sync = { DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+    bool ok = true;
+    for (uint32_t y = 0; y < resp.height && ok; y += resp.height / 8 + 1) {
+        const unsigned char* p = px + resp.offset + y * resp.stride + resp.width / 2 * 4;
+        ok = abs(p[0] - 0x40) <= 2 && abs(p[1] - 0x80) <= 2 && abs(p[2] - 0xc0) <= 2;
+    }
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    munmap(px, resp.size);
+    return ok;
+}
+
+static void run_client(int id)
+{
+    int sock = blur_client_connect(sock_path);
+    if (sock < 0) {
+        err_quit("connect %s: %s\n", sock_path, strerror(-sock));
+    }
+
+    vector<unsigned char> pixels((size_t)width * height * 4);
+    for (size_t i = 0; i < pixels.size(); i += 4) {
+        pixels[i] = 0x40;
+        pixels[i+1] = 0x80;
+        pixels[i+2] = 0xc0;
+        pixels[i+3] = 0xff;
+    }
+    int src_fd = blur_client_memfd(pixels.data(), pixels.size());
+    if (src_fd < 0) {
+        err_quit("memfd: %s\n", strerror(-src_fd));
+    }
+
+    unsigned int rnd = id;
+    vector<double> sent(requests);
+    int in_flight = 0, next = 0, done = 0;
+    while (done < requests) {
+        while (in_flight < depth && next < requests) {
+            struct blur_request req;
+            blur_request_init(&req, width, height, BLUR_FORMAT_RGBA8888);
+            req.id = next;
+            req.priority = rand_r(&rnd) % 4;
+            req.radius = radius;
+            req.passes = passes;
+            if (dmabuf) req.flags |= BLUR_FLAG_DMABUF;
+
+            sent[next] = now_ms();
+            int ret = blur_client_send(sock, &req, src_fd);
+            if (ret < 0) {
+                err_quit("send: %s\n", strerror(-ret));
+            }
+            next++;
+            in_flight++;
+        }
+
+        struct blur_response resp;
+        int fd;
+        int ret = blur_client_recv(sock, &resp, &fd);
+        if (ret < 0) {
+            err_quit("recv: %s\n", strerror(-ret));
+        }
+
+        bool ok = resp.status == 0 && resp.id < (uint64_t)requests && check_result(resp, fd);
+        if (fd >= 0) close(fd);
+
+        lock_guard<mutex> lk(stats_lock);
+        if (ok && dmabuf && !layout_shown) {
+            printf("dma-buf fourcc %.4s modifier 0x%llx stride %u offset %u, pixels %s\n",
+                    (const char*)&resp.fourcc, (unsigned long long)resp.modifier, resp.stride,
+                    resp.offset, resp.modifier == 0 ? "checked" : "not checked (tiled)");
+            layout_shown = true;
+        }
+        if (ok) {
+            latencies.push_back(now_ms() - sent[resp.id]);
+        } else {
+            fprintf(stderr, "client %d: request %llu failed, status %d\n", id,
+                    (unsigned long long)resp.id, resp.status);
+            failures++;
+        }
+        in_flight--;
+        done++;
+    }
+
+    close(src_fd);
+    close(sock);
+}
+
+static void usage()
+{
+    err_quit("usage: blur_loadgen socket\n"
+            "\t[-c clients] concurrent connections (default 4)\n"
+            "\t[-n requests] requests per client (default 50)\n"
+            "\t[-q depth] requests in flight per client (default 2)\n"
+            "\t[-W width] [-H height] source size (default 1920x1080)\n"
+            "\t[-r radius] [-p passes] blur parameters\n"
+            "\t[-z] ask for results as dma-bufs (daemon on -B gbm)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "c:n:q:W:H:r:p:zh")) != -1) {
+        switch(ch) {
+            case 'c': clients = atoi(optarg); break;
+            case 'n': requests = atoi(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'W': width = atoi(optarg); break;
+            case 'H': height = atoi(optarg); break;
+            case 'r': radius = atoi(optarg); break;
+            case 'p': passes = atoi(optarg); break;
+            case 'z': dmabuf = true; break;
+            case 'h':
+            default: usage(); break;
+        }
+    }
+
+    if (optind < argc) {
+        sock_path = argv[optind];
+    }
+
+    if (!sock_path || clients < 1 || requests < 1 || depth < 1 || width < 4 || height < 4) {
+        usage();
+    }
+
+    double started = now_ms();
+    vector<thread> threads;
+    for (int i = 0; i < clients; i++) {
+        threads.push_back(thread(run_client, i));
+    }
+    for (auto& t: threads) {
+        t.join();
+    }
+    double elapsed = now_ms() - started;
+
+    size_t n = latencies.size();
+    sort(latencies.begin(), latencies.end());
+    printf("%d clients, %zu ok, %d failed, %.1f requests/s\n", clients, n, failures,
+            n * 1000.0 / elapsed);
+    if (n > 0) {
+        printf("latency ms: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n", latencies[n/2],
+                latencies[n*9/10], latencies[n*99/100], latencies[n-1]);
+    }
+
+    return failures || n == 0 ? 1 : 0;
+}
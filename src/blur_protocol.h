@@ -0,0 +1,63 @@
+#ifndef BLUR_PROTOCOL_H
+#define BLUR_PROTOCOL_H
+
+/*
+ * wire protocol of the blur_image daemon (blur_image -D socket).
+ *
+ * the socket is a SOCK_SEQPACKET unix socket, every packet is exactly one
+ * struct. a request carries the fd of the source pixels (memfd or linear
+ * dma-buf) as SCM_RIGHTS, a successful response carries a memfd holding
+ * the blurred pixels, or with BLUR_FLAG_DMABUF the dma-buf the daemon
+ * rendered them into. requests on one connection may be pipelined, the
+ * daemon answers them by priority, so match responses by id.
+ */
+
+#include <stdint.h>
+
+#define BLUR_PROTO_MAGIC    0x52554c42 /* "BLUR" */
+#define BLUR_PROTO_VERSION  2
+
+enum blur_pixel_format {
+    BLUR_FORMAT_RGBA8888 = 0,
+    BLUR_FORMAT_RGB888 = 1,
+};
+
+enum blur_request_flags {
+    BLUR_FLAG_BRIGHTNESS = 1 << 0, /* same as -b */
+    /* answer with a dma-buf of the result to import as it is, described by
+     * fourcc, modifier, offset and stride. needs a daemon on the gbm
+     * backend (-B gbm), -EOPNOTSUPP otherwise */
+    BLUR_FLAG_DMABUF = 1 << 1,
+};
+
+struct blur_request {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t id;        /* echoed back in the response */
+    int32_t priority;   /* higher is served first, FIFO within a priority */
+    uint32_t format;    /* enum blur_pixel_format */
+    uint32_t width, height;
+    uint32_t stride;    /* bytes per row of the source */
+    int32_t radius;     /* -r */
+    int32_t passes;     /* -p */
+    float sigma;        /* -S */
+    float lightness;    /* -l, 1.0 keeps it */
+    float saturation;   /* -s, 1.0 keeps it */
+    uint32_t flags;     /* enum blur_request_flags */
+};
+
+struct blur_response {
+    uint32_t magic;
+    int32_t status;     /* 0 or -errno */
+    uint64_t id;
+    uint32_t format;    /* result is always BLUR_FORMAT_RGBA8888 */
+    uint32_t width, height;
+    uint32_t stride;
+    uint32_t size;      /* bytes of pixel data in the returned fd */
+    uint32_t fourcc;    /* DRM fourcc, DRM_FORMAT_ABGR8888 is RGBA8888 */
+    uint32_t offset;    /* of the first row in the fd */
+    uint64_t modifier;  /* DRM format modifier, 0 (linear) for a memfd,
+                           DRM_FORMAT_MOD_INVALID for an implicit layout */
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <string>
+
+#include "cpu_blur.h"
+
+using namespace std;
+
+#define err_quit(fmt, ...) do { \
+    fprintf(stderr, fmt, ## __VA_ARGS__); \
+    exit(-1); \
+} while (0)
+
+// runs blur_image modes on an image and compares every result with an exact
+// Gaussian of the sigma the mode approximates, printing a table of speed
+// against quality
+
+static const char* blur_image = "./blur_image";
+static int runs = 3;
+static bool hardware = false;
+static vector<string> modes;
+
+static const char* default_modes[] = {
+    "-r 9", "-r 19", "-r 29", "-r 49",
+    "-r 19 -p 2", "-r 19 -p 4",
+    "-r 19 -S 1.5", "-r 19 -S 2",
+    "-r 19 -t", "-r 29 -t",
+};
+
+struct timing {
+    double render, total;
+};
+
+// value following flag in a mode, or def
+static float mode_param(const string& mode, const char* flag, float def)
+{
+    size_t at = (" " + mode + " ").find(string(" ") + flag + " ");
+    return at == string::npos ? def : atof(mode.c_str() + at + strlen(flag) + 1);
+}
+
+static string quote(const string& s)
+{
+    string out = "'";
+    for (char c: s) {
+        if (c == '\'') out += "'\\''";
+        else out += c;
+    }
+    return out + "'";
+}
+
+static bool run_mode(const string& mode, const string& input, const string& output,
+        timing& t)
+{
+    string cmd = string(hardware ? "" : "LIBGL_ALWAYS_SOFTWARE=1 ") + quote(blur_image) +
+        " -T " + (hardware ? "" : "-B surfaceless ") + mode + " " + quote(input) +
+        " -o " + quote(output) + " 2>&1 >/dev/null";
+
+    FILE* fp = popen(cmd.c_str(), "r");
+    if (!fp) {
+        return false;
+    }
+
+    char line[1024];
+    bool found = false;
+    while (fgets(line, sizeof line, fp)) {
+        const char* render = strstr(line, "render ");
+        const char* total = strstr(line, "total ");
+        if (render && total) {
+            t.render = atof(render + 7);
+            t.total = atof(total + 6);
+            found = true;
+        }
+    }
+    return pclose(fp) == 0 && found;
+}
+
+static void usage()
+{
+    err_quit("usage: blur_quality image\n"
+            "\t[-b blur_image] binary to run (default ./blur_image)\n"
+            "\t[-m \"options\"] blur_image options of one mode, repeatable\n"
+            "\t[-n runs] runs per mode, the median time is reported (default 3)\n"
+            "\t[-g] use the default EGL backend instead of forcing llvmpipe\n"
+            "image is a PPM, PAM or raw file\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+    while ((ch = getopt(argc, argv, "b:m:n:gh")) != -1) {
+        switch(ch) {
+            case 'b': blur_image = optarg; break;
+            case 'm': modes.push_back(optarg); break;
+            case 'n': runs = atoi(optarg); break;
+            case 'g': hardware = true; break;
+            case 'h':
+            default: usage(); break;
+        }
+    }
+
+    if (optind >= argc || runs < 1) {
+        usage();
+    }
+    string input = argv[optind];
+
+    if (modes.empty()) {
+        modes.assign(default_modes, default_modes + sizeof default_modes / sizeof default_modes[0]);
+    }
+
+    float_image src;
+    if (!read_image(input, src)) {
+        err_quit("%s: not a PPM, PAM or raw image\n", input.c_str());
+    }
+
+    char dir[] = "/tmp/blur_quality.XXXXXX";
+    if (!mkdtemp(dir)) {
+        err_quit("mkdtemp failed\n");
+    }
+    string output = string(dir) + "/out.pam";
+
+    printf("| mode | sigma | render ms | total ms | PSNR dB | SSIM |\n");
+    printf("|------|-------|-----------|----------|---------|------|\n");
+
+    map<float, float_image> references;
+    for (auto& mode: modes) {
+        int radius = mode_param(mode, "-r", 19);
+        float spread = mode_param(mode, "-S", 1.0f), downscale = mode_param(mode, "-x", 0.25f);
+        float target = mode_param(mode, "-G", 0);
+        int passes = target > 0 ? passes_for_sigma(target, radius, spread, downscale) :
+            mode_param(mode, "-p", 1);
+        float sigma = equivalent_sigma(radius, spread, passes, downscale);
+        if (target > 0 && (" " + mode + " ").find(" -B cpu ") != string::npos) {
+            // the recursive blur runs at the sigma asked for
+            sigma = target;
+        }
+
+        vector<timing> times;
+        for (int i = 0; i < runs; i++) {
+            timing t;
+            if (!run_mode(mode, input, output, t)) {
+                err_quit("%s %s failed\n", blur_image, mode.c_str());
+            }
+            times.push_back(t);
+        }
+        sort(times.begin(), times.end(), [](const timing& a, const timing& b) {
+            return a.total < b.total;
+        });
+
+        float_image result;
+        if (!read_image(output, result) || result.width != src.width ||
+                result.height != src.height) {
+            err_quit("%s: bad output for %s\n", output.c_str(), mode.c_str());
+        }
+
+        auto ref = references.find(sigma);
+        if (ref == references.end()) {
+            gaussian_blur(src, sigma, references[sigma]);
+            ref = references.find(sigma);
+        }
+
+        printf("| `%s` | %.2f | %.2f | %.2f | %.2f | %.4f |\n", mode.c_str(), sigma,
+                times[runs/2].render, times[runs/2].total, psnr(result, ref->second),
+                ssim(result, ref->second));
+        fflush(stdout);
+    }
+
+    unlink(output.c_str());
+    rmdir(dir);
+    return 0;
+}
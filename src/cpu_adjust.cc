@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "cpu_adjust.h"
+#include "cpu_simd.h"
+
+using namespace std;
+
+const char* cpu_adjust_simd()
+{
+    return SIMD_NAME;
+}
+
+// one row of interleaved bytes as planes of floats in [0, 1], padded to
+// whole vectors
+struct row_planes {
+    vector<float> r, g, b;
+
+    explicit row_planes(int w)
+    {
+        size_t n = (w + LANES - 1) / LANES * LANES;
+        r.assign(n, 0.0f);
+        g.assign(n, 0.0f);
+        b.assign(n, 0.0f);
+    }
+
+    void load(const unsigned char* row, int w, int ncomp)
+    {
+        for (int x = 0; x < w; x++) {
+            r[x] = row[x*ncomp] * (1.0f / 255.0f);
+            g[x] = row[x*ncomp+1] * (1.0f / 255.0f);
+            b[x] = row[x*ncomp+2] * (1.0f / 255.0f);
+        }
+    }
+
+    // clamps and rounds like a UNORM8 render target
+    void store(unsigned char* row, int w, int ncomp) const
+    {
+        for (int x = 0; x < w; x++) {
+            row[x*ncomp] = (unsigned char)(fminf(fmaxf(r[x], 0.0f), 1.0f) * 255.0f + 0.5f);
+            row[x*ncomp+1] = (unsigned char)(fminf(fmaxf(g[x], 0.0f), 1.0f) * 255.0f + 0.5f);
+            row[x*ncomp+2] = (unsigned char)(fminf(fmaxf(b[x], 0.0f), 1.0f) * 255.0f + 0.5f);
+        }
+    }
+};
+
+// fract() of x in [0, 3)
+static inline vf fract3(vf x)
+{
+    x = vsub(x, sel_ge(x, vset(1.0f), vset(0.0f), vset(1.0f)));
+    return vsub(x, sel_ge(x, vset(1.0f), vset(0.0f), vset(1.0f)));
+}
+
+// abs(fract(h + k) * 6 - 3) - 1 clamped to [0, 1], one channel of hsv2rgb
+static inline vf hue_channel(vf h, float k)
+{
+    vf p = vabs(vsub(vmul(fract3(vadd(h, vset(k))), vset(6.0f)), vset(3.0f)));
+    return vmin(vmax(vsub(p, vset(1.0f)), vset(0.0f)), vset(1.0f));
+}
+
+// rgb2hsv, scale, hsv2rgb of vs_set_lightness
+static void hsl_row(row_planes& px, int w, float lightness, float saturation)
+{
+    const vf e = vset(1.0e-10f), one = vset(1.0f);
+    for (int x = 0; x < w; x += LANES) {
+        vf r = vload(&px.r[x]), g = vload(&px.g[x]), b = vload(&px.b[x]);
+
+        // p = mix(vec4(c.bg, K.wz), vec4(c.gb, K.xy), step(c.b, c.g))
+        vf p_x = sel_ge(g, b, b, g);
+        vf p_y = sel_ge(g, b, g, b);
+        vf p_z = sel_ge(g, b, vset(-1.0f), vset(0.0f));
+        vf p_w = sel_ge(g, b, vset(2.0f / 3.0f), vset(-1.0f / 3.0f));
+
+        // q = mix(vec4(p.xyw, c.r), vec4(c.r, p.yzx), step(p.x, c.r))
+        vf q_x = sel_ge(r, p_x, p_x, r);
+        vf q_y = p_y;
+        vf q_z = sel_ge(r, p_x, p_w, p_z);
+        vf q_w = sel_ge(r, p_x, r, p_x);
+
+        vf d = vsub(q_x, vmin(q_w, q_y));
+        vf h = vabs(vadd(q_z, vdiv(vsub(q_w, q_y), vadd(vmul(vset(6.0f), d), e))));
+        vf s = vmul(vdiv(d, vadd(q_x, e)), vset(saturation));
+        vf v = vmul(q_x, vset(lightness));
+
+        // c.z * mix(K.xxx, clamp(p - K.xxx, 0.0, 1.0), c.y)
+        vstore(&px.r[x], vmul(v, vadd(one, vmul(s, vsub(hue_channel(h, 1.0f), one)))));
+        vstore(&px.g[x], vmul(v, vadd(one, vmul(s, vsub(hue_channel(h, 2.0f / 3.0f), one)))));
+        vstore(&px.b[x], vmul(v, vadd(one, vmul(s, vsub(hue_channel(h, 1.0f / 3.0f), one)))));
+    }
+}
+
+void cpu_adjust_hsl(unsigned char* pixels, int w, int h, int ncomp, float lightness,
+        float saturation)
+{
+    parallel_rows(h, [=](int y0, int y1) {
+        row_planes px(w);
+        for (int y = y0; y < y1; y++) {
+            unsigned char* row = pixels + (size_t)y * w * ncomp;
+            px.load(row, w, ncomp);
+            hsl_row(px, w, lightness, saturation);
+            px.store(row, w, ncomp);
+        }
+    });
+}
+
+int cpu_brightness(const unsigned char* pixels, int w, int h, int ncomp)
+{
+    vector<long> sums(h);
+    parallel_rows(h, [&](int y0, int y1) {
+        row_planes px(w);
+        vector<float> out(px.r.size());
+        for (int y = y0; y < y1; y++) {
+            px.load(pixels + (size_t)y * w * ncomp, w, ncomp);
+            // sqrt(dot(c.rgb * c.rgb, vec3(0.241, 0.691, 0.068)))
+            for (int x = 0; x < w; x += LANES) {
+                vf r = vload(&px.r[x]), g = vload(&px.g[x]), b = vload(&px.b[x]);
+                vf sq = vadd(vadd(vmul(vmul(r, r), vset(0.241f)), vmul(vmul(g, g), vset(0.691f))),
+                        vmul(vmul(b, b), vset(0.068f)));
+                vstore(&out[x], vsqrt(sq));
+            }
+            // the shader result is stored in an 8 bit alpha before summing
+            long sum = 0;
+            for (int x = 0; x < w; x++) {
+                sum += (long)(fminf(out[x], 1.0f) * 255.0f + 0.5f);
+            }
+            sums[y] = sum;
+        }
+    });
+
+    long total = 0;
+    for (long s: sums) {
+        total += s;
+    }
+    return (int)(total / ((long)w * h));
+}
+
+void cpu_darken(unsigned char* pixels, int w, int h, int ncomp)
+{
+    // round(c * 0.8) in integers, left to the compiler to vectorize
+    parallel_rows(h, [=](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            unsigned char* row = pixels + (size_t)y * w * ncomp;
+            for (int x = 0; x < w; x++) {
+                for (int c = 0; c < 3; c++) {
+                    row[x*ncomp+c] = (unsigned char)((row[x*ncomp+c] * 8 + 5) / 10);
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,25 @@
+#ifndef CPU_ADJUST_H
+#define CPU_ADJUST_H
+
+/*
+ * CPU versions of the HSL pass (vs_set_lightness) and the brightness passes
+ * (vs_save_brightness, vs_set_brightness), used by blur_image built with
+ * CPU_ADJUST. they work in place on tightly packed RGB or RGBA rows at tex
+ * size, split across threads, with SSE2, NEON or MSA where available.
+ */
+
+// scale saturation and value in hsv space like vs_set_lightness, alpha is
+// kept
+void cpu_adjust_hsl(unsigned char* pixels, int w, int h, int ncomp, float lightness,
+        float saturation);
+
+// mean of the per texel brightness vs_save_brightness computes, 0-255
+int cpu_brightness(const unsigned char* pixels, int w, int h, int ncomp);
+
+// rgb * 0.8 like vs_set_brightness
+void cpu_darken(unsigned char* pixels, int w, int h, int ncomp);
+
+// name of the vector unit in use, "scalar" without one
+const char* cpu_adjust_simd();
+
+#endif
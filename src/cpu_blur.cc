@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
+
+#include "cpu_blur.h"
+
+using namespace std;
+
+bool read_image(const string& path, float_image& img)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    char magic[4] = {0};
+    int w = 0, h = 0, n = 0, maxval = 0;
+    bool ok = fread(magic, 1, 2, fp) == 2;
+    if (ok && magic[0] == 'P' && magic[1] == '6') {
+        ok = fscanf(fp, "%d %d %d", &w, &h, &maxval) == 3 && fgetc(fp) != EOF;
+        n = 3;
+    } else if (ok && magic[0] == 'P' && magic[1] == '7') {
+        char line[128];
+        while (ok && (ok = fgets(line, sizeof line, fp) != NULL)) {
+            if (strncmp(line, "ENDHDR", 6) == 0) break;
+            sscanf(line, "WIDTH %d", &w);
+            sscanf(line, "HEIGHT %d", &h);
+            sscanf(line, "DEPTH %d", &n);
+            sscanf(line, "MAXVAL %d", &maxval);
+        }
+    } else if (ok && fread(magic + 2, 1, 2, fp) == 2 && memcmp(magic, "BLRW", 4) == 0) {
+        uint32_t dims[2];
+        uint16_t comps[2];
+        ok = fread(dims, 4, 2, fp) == 2 && fread(comps, 2, 2, fp) == 2;
+        w = dims[0];
+        h = dims[1];
+        n = comps[0];
+        maxval = 255;
+    } else {
+        ok = false;
+    }
+
+    if (!ok || w <= 0 || h <= 0 || n < 3 || n > 4 || maxval != 255) {
+        fclose(fp);
+        return false;
+    }
+
+    vector<unsigned char> data((size_t)w * h * n);
+    ok = fread(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+
+    img.width = w;
+    img.height = h;
+    img.ncomp = n;
+    img.pixels.assign(data.begin(), data.end());
+    return ok;
+}
+
+// one direction of the separable blur, k holds the weights from the center
+// out
+static void blur_1d(const float_image& src, const vector<float>& k, bool vertical,
+        float_image& dst)
+{
+    int r = k.size() - 1;
+    int w = src.width, h = src.height, n = src.ncomp;
+    dst.width = w;
+    dst.height = h;
+    dst.ncomp = n;
+    dst.pixels.assign(src.pixels.size(), 0.0f);
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            float* out = &dst.pixels[((size_t)y * w + x) * n];
+            for (int i = -r; i <= r; i++) {
+                int sx = vertical ? x : min(max(x + i, 0), w - 1);
+                int sy = vertical ? min(max(y + i, 0), h - 1) : y;
+                const float* in = &src.pixels[((size_t)sy * w + sx) * n];
+                float wt = k[abs(i)];
+                for (int c = 0; c < n; c++) {
+                    out[c] += in[c] * wt;
+                }
+            }
+        }
+    }
+}
+
+void gaussian_blur(const float_image& src, float sigma, float_image& dst)
+{
+    int r = max(1, (int)ceilf(sigma * 3.0f));
+    vector<float> k(r + 1);
+    double sum = 0;
+    for (int i = 0; i <= r; i++) {
+        k[i] = expf(-(float)(i * i) / (2.0f * sigma * sigma));
+        sum += i ? 2 * k[i] : k[i];
+    }
+    for (auto& v: k) {
+        v /= sum;
+    }
+
+    float_image tmp;
+    blur_1d(src, k, true, tmp);
+    blur_1d(tmp, k, false, dst);
+}
+
+float equivalent_sigma(int radius, float sample_distance, int passes, float downscale)
+{
+    // binomial weights of order N = 2 * radius + 2 have variance N / 4 taps,
+    // one pass runs it once per direction
+    float taps = (2.0f * radius + 2.0f) / 4.0f * passes;
+    float scale = 1.0f / downscale;
+    float blur = taps * sample_distance * sample_distance * scale * scale;
+
+    // box of scale x scale texels down and a bilinear tent of the same
+    // width up
+    float box = (scale * scale - 1.0f) / 12.0f;
+    float tent = scale * scale / 6.0f;
+    return sqrtf(blur + box + tent);
+}
+
+int passes_for_sigma(float sigma, int radius, float sample_distance, float downscale)
+{
+    float scale = 1.0f / downscale;
+    float pass = (2.0f * radius + 2.0f) / 4.0f * sample_distance * sample_distance * scale * scale;
+    float blur = sigma * sigma - (scale * scale - 1.0f) / 12.0f - scale * scale / 6.0f;
+    return max(1, (int)ceilf(blur / pass));
+}
+
+double psnr(const float_image& a, const float_image& b)
+{
+    size_t count = (size_t)a.width * a.height;
+    double err = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (int c = 0; c < 3; c++) {
+            double d = a.pixels[i * a.ncomp + c] - b.pixels[i * b.ncomp + c];
+            err += d * d;
+        }
+    }
+
+    err /= count * 3;
+    return err > 0 ? 10.0 * log10(255.0 * 255.0 / err) : 99.0;
+}
+
+static void luma(const float_image& src, float_image& dst)
+{
+    size_t count = (size_t)src.width * src.height;
+    dst.width = src.width;
+    dst.height = src.height;
+    dst.ncomp = 1;
+    dst.pixels.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        const float* p = &src.pixels[i * src.ncomp];
+        dst.pixels[i] = 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+    }
+}
+
+double ssim(const float_image& a, const float_image& b)
+{
+    const double c1 = 6.5025, c2 = 58.5225; // (0.01 * 255)^2, (0.03 * 255)^2
+
+    float_image ya, yb, aa, bb, ab;
+    luma(a, ya);
+    luma(b, yb);
+    aa = ya;
+    bb = yb;
+    ab = ya;
+    for (size_t i = 0; i < ya.pixels.size(); i++) {
+        aa.pixels[i] = ya.pixels[i] * ya.pixels[i];
+        bb.pixels[i] = yb.pixels[i] * yb.pixels[i];
+        ab.pixels[i] = ya.pixels[i] * yb.pixels[i];
+    }
+
+    float_image mu_a, mu_b, s_aa, s_bb, s_ab;
+    gaussian_blur(ya, 1.5f, mu_a);
+    gaussian_blur(yb, 1.5f, mu_b);
+    gaussian_blur(aa, 1.5f, s_aa);
+    gaussian_blur(bb, 1.5f, s_bb);
+    gaussian_blur(ab, 1.5f, s_ab);
+
+    double total = 0;
+    for (size_t i = 0; i < ya.pixels.size(); i++) {
+        double ma = mu_a.pixels[i], mb = mu_b.pixels[i];
+        double va = s_aa.pixels[i] - ma * ma;
+        double vb = s_bb.pixels[i] - mb * mb;
+        double cov = s_ab.pixels[i] - ma * mb;
+        total += (2 * ma * mb + c1) * (2 * cov + c2) /
+            ((ma * ma + mb * mb + c1) * (va + vb + c2));
+    }
+    return total / ya.pixels.size();
+}
@@ -0,0 +1,38 @@
+#ifndef CPU_BLUR_H
+#define CPU_BLUR_H
+
+/*
+ * exact float Gaussian and image metrics, the reference blur_quality and
+ * the blur_image -A tuner measure the GPU modes against.
+ */
+
+#include <string>
+#include <vector>
+
+struct float_image {
+    int width, height, ncomp;
+    std::vector<float> pixels; // rows top first, ncomp values of 0-255 per pixel
+};
+
+// binary PPM (P6), PAM (P7) or raw BLRW image with 8 bit components
+bool read_image(const std::string& path, float_image& img);
+
+// separable Gaussian truncated at 3 sigma, edges are clamped like
+// GL_CLAMP_TO_EDGE
+void gaussian_blur(const float_image& src, float sigma, float_image& dst);
+
+// sigma at full resolution of the blur blur_image approximates with a
+// radius, sample distance and passes at the given downscale factor,
+// including the box downsample and bilinear upscale
+float equivalent_sigma(int radius, float sample_distance, int passes, float downscale);
+
+// fewest passes whose equivalent_sigma() reaches sigma, at least 1
+int passes_for_sigma(float sigma, int radius, float sample_distance, float downscale);
+
+// over red, green and blue, alpha is ignored
+double psnr(const float_image& a, const float_image& b);
+
+// mean SSIM of BT.601 luma with an 11x11 Gaussian window of sigma 1.5
+double ssim(const float_image& a, const float_image& b);
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef CPU_SIMD_H
+#define CPU_SIMD_H
+
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <functional>
+
+/*
+ * four float lanes on every vector unit, one lane without: SSE2, NEON, MSA
+ * or scalar. the CPU passes (cpu_adjust.cc, iir_blur.cc) are written once
+ * against these helpers; sel_ge(a, b, x, y) is a >= b ? y : x per lane, the
+ * branchless form of step() + mix() in the shaders.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+#define LANES 4
+#define SIMD_NAME "sse2"
+typedef __m128 vf;
+
+static inline vf vset(float a) { return _mm_set1_ps(a); }
+static inline vf vload(const float* p) { return _mm_loadu_ps(p); }
+static inline void vstore(float* p, vf a) { _mm_storeu_ps(p, a); }
+static inline vf vadd(vf a, vf b) { return _mm_add_ps(a, b); }
+static inline vf vsub(vf a, vf b) { return _mm_sub_ps(a, b); }
+static inline vf vmul(vf a, vf b) { return _mm_mul_ps(a, b); }
+static inline vf vdiv(vf a, vf b) { return _mm_div_ps(a, b); }
+static inline vf vmin(vf a, vf b) { return _mm_min_ps(a, b); }
+static inline vf vmax(vf a, vf b) { return _mm_max_ps(a, b); }
+static inline vf vsqrt(vf a) { return _mm_sqrt_ps(a); }
+static inline vf vabs(vf a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+static inline vf sel_ge(vf a, vf b, vf x, vf y)
+{
+    vf m = _mm_cmpge_ps(a, b);
+    return _mm_or_ps(_mm_and_ps(m, y), _mm_andnot_ps(m, x));
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+
+#define LANES 4
+#define SIMD_NAME "neon"
+typedef float32x4_t vf;
+
+static inline vf vset(float a) { return vdupq_n_f32(a); }
+static inline vf vload(const float* p) { return vld1q_f32(p); }
+static inline void vstore(float* p, vf a) { vst1q_f32(p, a); }
+static inline vf vadd(vf a, vf b) { return vaddq_f32(a, b); }
+static inline vf vsub(vf a, vf b) { return vsubq_f32(a, b); }
+static inline vf vmul(vf a, vf b) { return vmulq_f32(a, b); }
+static inline vf vmin(vf a, vf b) { return vminq_f32(a, b); }
+static inline vf vmax(vf a, vf b) { return vmaxq_f32(a, b); }
+static inline vf vabs(vf a) { return vabsq_f32(a); }
+#ifdef __aarch64__
+static inline vf vdiv(vf a, vf b) { return vdivq_f32(a, b); }
+static inline vf vsqrt(vf a) { return vsqrtq_f32(a); }
+#else
+// ARMv7 has estimates only, two Newton steps reach float precision
+static inline vf vdiv(vf a, vf b)
+{
+    vf r = vrecpeq_f32(b);
+    r = vmulq_f32(vrecpsq_f32(b, r), r);
+    r = vmulq_f32(vrecpsq_f32(b, r), r);
+    return vmulq_f32(a, r);
+}
+static inline vf vsqrt(vf a)
+{
+    vf x = vmaxq_f32(a, vdupq_n_f32(1e-20f));
+    vf r = vrsqrteq_f32(x);
+    r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(x, r), r), r);
+    r = vmulq_f32(vrsqrtsq_f32(vmulq_f32(x, r), r), r);
+    return vmulq_f32(a, r);
+}
+#endif
+static inline vf sel_ge(vf a, vf b, vf x, vf y) { return vbslq_f32(vcgeq_f32(a, b), y, x); }
+
+#elif defined(__mips_msa)
+#include <msa.h>
+
+#define LANES 4
+#define SIMD_NAME "msa"
+typedef v4f32 vf;
+
+static inline vf vset(float a) { return (v4f32){ a, a, a, a }; }
+static inline vf vload(const float* p) { return (v4f32)__msa_ld_w((void*)p, 0); }
+static inline void vstore(float* p, vf a) { __msa_st_w((v4i32)a, p, 0); }
+static inline vf vadd(vf a, vf b) { return __msa_fadd_w(a, b); }
+static inline vf vsub(vf a, vf b) { return __msa_fsub_w(a, b); }
+static inline vf vmul(vf a, vf b) { return __msa_fmul_w(a, b); }
+static inline vf vdiv(vf a, vf b) { return __msa_fdiv_w(a, b); }
+static inline vf vmin(vf a, vf b) { return __msa_fmin_w(a, b); }
+static inline vf vmax(vf a, vf b) { return __msa_fmax_w(a, b); }
+static inline vf vsqrt(vf a) { return __msa_fsqrt_w(a); }
+static inline vf vabs(vf a) { return (v4f32)__msa_bclri_w((v4u32)a, 31); }
+static inline vf sel_ge(vf a, vf b, vf x, vf y)
+{
+    v4i32 m = __msa_fcle_w(b, a);
+    return (v4f32)__msa_bsel_v((v16u8)m, (v16u8)x, (v16u8)y);
+}
+
+#else
+
+#define LANES 1
+#define SIMD_NAME "scalar"
+typedef float vf;
+
+static inline vf vset(float a) { return a; }
+static inline vf vload(const float* p) { return *p; }
+static inline void vstore(float* p, vf a) { *p = a; }
+static inline vf vadd(vf a, vf b) { return a + b; }
+static inline vf vsub(vf a, vf b) { return a - b; }
+static inline vf vmul(vf a, vf b) { return a * b; }
+static inline vf vdiv(vf a, vf b) { return a / b; }
+static inline vf vmin(vf a, vf b) { return fminf(a, b); }
+static inline vf vmax(vf a, vf b) { return fmaxf(a, b); }
+static inline vf vsqrt(vf a) { return sqrtf(a); }
+static inline vf vabs(vf a) { return fabsf(a); }
+static inline vf sel_ge(vf a, vf b, vf x, vf y) { return a >= b ? y : x; }
+
+#endif
+
+// rows [0, h) in bands, one per thread and at least grain rows each
+static inline void parallel_rows(int h, const std::function<void(int, int)>& fn,
+        int grain = 64)
+{
+    int n = std::max(1, std::min((int)std::thread::hardware_concurrency(), h / grain));
+    if (n == 1) {
+        fn(0, h);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n; i++) {
+        workers.push_back(std::thread(fn, h * i / n, h * (i + 1) / n));
+    }
+    for (auto& t: workers) {
+        t.join();
+    }
+}
+
+#endif
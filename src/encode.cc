@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <jpeglib.h>
+#include <zlib.h>
+
+#include "encode.h"
+#include "cpu_simd.h"
+
+using namespace std;
+
+#define err_quit(fmt, ...) do { \
+    fprintf(stderr, fmt, ## __VA_ARGS__); \
+    exit(-1); \
+} while (0)
+
+#define PNG_LEVEL 6
+
+static void write_file(const string& path, const string& data)
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp || fwrite(data.data(), 1, data.size(), fp) != data.size() || fclose(fp) != 0) {
+        err_quit("%s: %s\n", path.c_str(), strerror(errno));
+    }
+}
+
+/*
+ * JPEG: every band is compressed as an image of its own with one restart
+ * interval per MCU row and the default Huffman tables, so all bands agree on
+ * tables and interval. the scan data of the bands, joined by the restart
+ * marker that ends each band, is the scan of the whole image; the markers
+ * are renumbered and the frame header takes the full height.
+ */
+#define MCU_ROWS 16 // rows of a 2x2 subsampled MCU
+
+static string jpeg_band(const unsigned char* rows, int w, int h, int quality)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    unsigned char* buf = NULL;
+    unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &buf, &size);
+
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.optimize_coding = FALSE;
+    cinfo.restart_in_rows = 1;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)(rows + (size_t)cinfo.next_scanline * w * 3);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    string out((char*)buf, size);
+    free(buf);
+    return out;
+}
+
+// offset of the scan data, past the SOS header; a height > 0 is written into
+// the frame header on the way
+static size_t jpeg_scan(string& jpg, int height)
+{
+    size_t at = 2;
+    while (at + 4 <= jpg.size() && (unsigned char)jpg[at] == 0xff) {
+        unsigned char marker = jpg[at+1];
+        size_t len = (unsigned char)jpg[at+2] << 8 | (unsigned char)jpg[at+3];
+        if (marker == 0xc0 && height > 0) {
+            jpg[at+5] = height >> 8;
+            jpg[at+6] = height & 0xff;
+        }
+        if (marker == 0xda) {
+            return at + 2 + len;
+        }
+        at += 2 + len;
+    }
+    err_quit("jpeg band without a scan\n");
+}
+
+// scan data of a band without its EOI, restart markers numbered from *rst
+static void append_scan(string& out, const string& jpg, size_t start, int* rst)
+{
+    size_t end = jpg.size() - 2;
+    size_t base = out.size();
+    out.append(jpg, start, end - start);
+    for (size_t i = base; i + 1 < out.size(); i++) {
+        if ((unsigned char)out[i] != 0xff) continue;
+        unsigned char c = out[i+1];
+        if (c >= 0xd0 && c <= 0xd7) {
+            out[i+1] = 0xd0 + ((*rst)++ & 7);
+        }
+        i++;
+    }
+}
+
+static void encode_jpeg(const string& path, const unsigned char* pixels, int w, int h,
+        int quality)
+{
+    int mcu_rows = (h + MCU_ROWS - 1) / MCU_ROWS;
+    vector<string> bands(mcu_rows);
+    parallel_rows(mcu_rows, [&](int m0, int m1) {
+        int y0 = m0 * MCU_ROWS, y1 = min(h, m1 * MCU_ROWS);
+        bands[m0] = jpeg_band(pixels + (size_t)y0 * w * 3, w, y1 - y0, quality);
+    }, 4);
+
+    string out;
+    int rst = 0;
+    for (int m = 0; m < mcu_rows; m++) {
+        if (bands[m].empty()) continue;
+        if (m == 0) {
+            size_t start = jpeg_scan(bands[m], h);
+            out.assign(bands[m], 0, start);
+            append_scan(out, bands[m], start, &rst);
+        } else {
+            out += (char)0xff;
+            out += (char)(0xd0 + (rst++ & 7));
+            append_scan(out, bands[m], jpeg_scan(bands[m], 0), &rst);
+        }
+    }
+    out += "\xff\xd9";
+    write_file(path, out);
+}
+
+/*
+ * PNG: rows are Paeth filtered against the image row above, so a band can
+ * filter on its own. each band is raw deflate ending in a sync flush (the
+ * last one in the final block), primed with the 32K of filtered data before
+ * it, and goes into an IDAT chunk of its own; the chunks together are one
+ * zlib stream whose adler32 is combined from the bands'.
+ */
+static void put32(string& s, uint32_t v)
+{
+    s += (char)(v >> 24);
+    s += (char)(v >> 16);
+    s += (char)(v >> 8);
+    s += (char)v;
+}
+
+static void paeth_row(const unsigned char* row, const unsigned char* up, int len, int bpp,
+        unsigned char* out)
+{
+    out[0] = 4;
+    for (int i = 0; i < len; i++) {
+        int a = i >= bpp ? row[i-bpp] : 0, b = up ? up[i] : 0;
+        int c = i >= bpp && up ? up[i-bpp] : 0;
+        int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        int pred = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        out[i+1] = row[i] - pred;
+    }
+}
+
+struct png_band {
+    string chunk; // "IDAT" and the compressed data
+    uint32_t adler;
+    size_t len; // filtered bytes
+};
+
+static void encode_png(const string& path, const unsigned char* pixels, int w, int h, int n)
+{
+    size_t row = (size_t)w * n, line = row + 1;
+    int dict_rows = (int)((32768 + line - 1) / line);
+    vector<png_band> bands(h);
+
+    parallel_rows(h, [&](int y0, int y1) {
+        int from = max(0, y0 - dict_rows);
+        vector<unsigned char> filtered(line * (y1 - from));
+        for (int y = from; y < y1; y++) {
+            paeth_row(pixels + y * row, y ? pixels + (y - 1) * row : NULL, (int)row, n,
+                    &filtered[line * (y - from)]);
+        }
+        const unsigned char* data = &filtered[line * (y0 - from)];
+        size_t len = line * (y1 - y0);
+
+        z_stream z;
+        memset(&z, 0, sizeof z);
+        if (deflateInit2(&z, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK) {
+            err_quit("%s: deflateInit2 failed\n", path.c_str());
+        }
+        if (y0 > from) {
+            size_t dict = min(line * (y0 - from), (size_t)32768);
+            deflateSetDictionary(&z, data - dict, dict);
+        }
+
+        png_band& band = bands[y0];
+        band.chunk = y0 == 0 ? string("IDAT\x78\x9c", 6) : string("IDAT");
+        size_t head = band.chunk.size();
+        band.chunk.resize(head + deflateBound(&z, len) + 16);
+        z.next_in = (Bytef*)data;
+        z.avail_in = len;
+        z.next_out = (Bytef*)&band.chunk[head];
+        z.avail_out = band.chunk.size() - head;
+
+        // the bound holds for zlib's own levels, more room is given if not
+        int flush = y1 == h ? Z_FINISH : Z_SYNC_FLUSH, ret;
+        for (;;) {
+            ret = deflate(&z, flush);
+            if (ret != Z_OK && ret != Z_BUF_ERROR) break;
+            if (flush == Z_SYNC_FLUSH && z.avail_in == 0 && z.avail_out > 0) break;
+            size_t used = band.chunk.size() - z.avail_out;
+            band.chunk.resize(band.chunk.size() * 2);
+            z.next_out = (Bytef*)&band.chunk[used];
+            z.avail_out = band.chunk.size() - used;
+        }
+        if (ret == Z_BUF_ERROR) ret = Z_OK; // a flush that had filled the room exactly
+        if (ret != (flush == Z_FINISH ? Z_STREAM_END : Z_OK) || z.avail_in != 0) {
+            err_quit("%s: deflate failed (%d)\n", path.c_str(), ret);
+        }
+        band.chunk.resize(band.chunk.size() - z.avail_out);
+        deflateEnd(&z);
+
+        band.adler = adler32(adler32(0, NULL, 0), data, len);
+        band.len = len;
+    });
+
+    string out("\x89PNG\r\n\x1a\n", 8);
+    string ihdr("IHDR");
+    put32(ihdr, w);
+    put32(ihdr, h);
+    ihdr += (char)8;
+    ihdr += (char)(n == 4 ? 6 : 2);
+    ihdr.append(3, '\0');
+
+    uint32_t adler = adler32(0, NULL, 0);
+    vector<string*> chunks(1, &ihdr);
+    for (auto& band: bands) {
+        if (band.chunk.empty()) continue;
+        adler = adler32_combine(adler, band.adler, band.len);
+        chunks.push_back(&band.chunk);
+    }
+    put32(*chunks.back(), adler);
+
+    string iend("IEND");
+    chunks.push_back(&iend);
+    for (auto chunk: chunks) {
+        put32(out, chunk->size() - 4);
+        out += *chunk;
+        put32(out, crc32(crc32(0, NULL, 0), (const Bytef*)chunk->data(), chunk->size()));
+    }
+    write_file(path, out);
+}
+
+bool encode_parallel(const string& path, const unsigned char* pixels, int w, int h, int n,
+        int quality)
+{
+    auto suffix = path.substr(path.find_last_of('.') + 1);
+    if ((suffix == "jpg" || suffix == "jpeg") && n == 3) {
+        encode_jpeg(path, pixels, w, h, quality);
+        return true;
+    }
+    if (suffix == "png") {
+        encode_png(path, pixels, w, h, n);
+        return true;
+    }
+    return false;
+}
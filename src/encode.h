@@ -0,0 +1,19 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+/*
+ * JPEG and PNG writers that split the image into row bands encoded on
+ * separate threads, for blur_image built with PARALLEL_ENCODE. the bands of
+ * a JPEG are restart intervals of one scan, those of a PNG deflate blocks
+ * of one zlib stream, so the files are ordinary baseline JPEGs and PNGs.
+ */
+
+#include <string>
+
+// rows of w pixels of n components (3, or 4 for PNG) without padding, JPEG
+// at the given quality; false when the suffix of path is neither jpg/jpeg
+// nor png
+bool encode_parallel(const std::string& path, const unsigned char* pixels, int w, int h, int n,
+        int quality);
+
+#endif
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "iir_blur.h"
+#include "cpu_simd.h"
+
+using namespace std;
+
+// columns are filtered in strips of this many pixels, a strip of RGBA
+// floats is one record of the recursion
+#define STRIP 16
+
+struct iir_coefs {
+    float B, b1, b2, b3;
+    float M[3][3]; // right edge initial values from the last three outputs
+};
+
+// Young, van Vliet: "Recursive implementation of the Gaussian filter", 1995
+static iir_coefs find_coefs(float sigma)
+{
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 :
+        3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double a1 = (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0;
+    double a2 = -(1.4281 * q * q + 1.26661 * q * q * q) / b0;
+    double a3 = 0.422205 * q * q * q / b0;
+
+    // Triggs, Sdika: "Boundary conditions for Young-van Vliet recursive
+    // filtering", 2006
+    double s = 1.0 / ((1.0 + a1 - a2 + a3) * (1.0 - a1 - a2 - a3) * (1.0 + a2 + (a1 - a3) * a3));
+    double M[3][3] = {
+        { -a3 * a1 + 1.0 - a3 * a3 - a2, (a3 + a1) * (a2 + a3 * a1), a3 * (a1 + a3 * a2) },
+        { a1 + a3 * a2, -(a2 - 1.0) * (a2 + a3 * a1), -a3 * (a3 * a1 + a3 * a3 + a2 - 1.0) },
+        { a3 * a1 + a2 + a1 * a1 - a2 * a2,
+            a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3,
+            a3 * (a1 + a3 * a2) },
+    };
+
+    iir_coefs k;
+    k.B = 1.0 - (a1 + a2 + a3);
+    k.b1 = a1;
+    k.b2 = a2;
+    k.b3 = a3;
+    // the paper's filter is not normalized, here both passes are scaled by B
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            k.M[i][j] = M[i][j] * s * k.B;
+        }
+    }
+    return k;
+}
+
+/*
+ * forward and backward recursion over n records of width floats, in place.
+ * buf has three records of room on either side, the data starts at record
+ * 3. width is a multiple of LANES: one RGBA pixel along a row, a strip of
+ * pixels down the columns.
+ */
+static void recurse(float* buf, int n, int width, const iir_coefs& k)
+{
+    float* x = buf + 3 * width;
+    const vf B = vset(k.B), b1 = vset(k.b1), b2 = vset(k.b2), b3 = vset(k.b3);
+
+    float last[STRIP * 4];
+    memcpy(last, x + (size_t)(n - 1) * width, width * sizeof(float));
+
+    // constant extension on the left, the filter starts in its steady state
+    for (int i = 1; i <= 3; i++) {
+        memcpy(x - i * width, x, width * sizeof(float));
+    }
+
+    for (int i = 0; i < n; i++) {
+        float* p = x + (size_t)i * width;
+        for (int c = 0; c < width; c += LANES) {
+            vf v = vmul(B, vload(p + c));
+            v = vadd(v, vmul(b1, vload(p + c - width)));
+            v = vadd(v, vmul(b2, vload(p + c - 2 * width)));
+            v = vadd(v, vmul(b3, vload(p + c - 3 * width)));
+            vstore(p + c, v);
+        }
+    }
+
+    // the last output and the two past the end are what a constant extension
+    // on the right would give, the backward pass starts before them
+    float* end = x + (size_t)(n - 1) * width;
+    for (int c = 0; c < width; c++) {
+        float u[3] = { end[c] - last[c], end[c - width] - last[c], end[c - 2 * width] - last[c] };
+        for (int i = 0; i < 3; i++) {
+            end[i * width + c] = k.M[i][0] * u[0] + k.M[i][1] * u[1] + k.M[i][2] * u[2] + last[c];
+        }
+    }
+
+    for (int i = n - 2; i >= 0; i--) {
+        float* p = x + (size_t)i * width;
+        for (int c = 0; c < width; c += LANES) {
+            vf v = vmul(B, vload(p + c));
+            v = vadd(v, vmul(b1, vload(p + c + width)));
+            v = vadd(v, vmul(b2, vload(p + c + 2 * width)));
+            v = vadd(v, vmul(b3, vload(p + c + 3 * width)));
+            vstore(p + c, v);
+        }
+    }
+}
+
+static inline unsigned char to_byte(float v)
+{
+    return (unsigned char)(fminf(fmaxf(v, 0.0f), 255.0f) + 0.5f);
+}
+
+// rows of src (ncomp 3 or 4) into RGBA rows of dst, which may be src
+static void blur_rows(const unsigned char* src, int stride, int ncomp, int w, int h,
+        const iir_coefs& k, unsigned char* dst)
+{
+    parallel_rows(h, [&](int y0, int y1) {
+        vector<float> buf((size_t)(w + 6) * 4);
+        float* x = &buf[3 * 4];
+        for (int y = y0; y < y1; y++) {
+            const unsigned char* in = src + (size_t)y * stride;
+            for (int i = 0; i < w; i++) {
+                x[i*4] = in[i*ncomp];
+                x[i*4+1] = in[i*ncomp+1];
+                x[i*4+2] = in[i*ncomp+2];
+                x[i*4+3] = ncomp == 4 ? in[i*4+3] : 255.0f;
+            }
+
+            recurse(buf.data(), w, 4, k);
+
+            unsigned char* out = dst + (size_t)y * w * 4;
+            for (int i = 0; i < w * 4; i++) {
+                out[i] = to_byte(x[i]);
+            }
+        }
+    });
+}
+
+// columns of an RGBA image in place, STRIP pixels at a time so a record is
+// contiguous
+static void blur_columns(unsigned char* img, int w, int h, const iir_coefs& k)
+{
+    int strips = (w + STRIP - 1) / STRIP;
+    parallel_rows(strips, [&](int s0, int s1) {
+        vector<float> buf((size_t)(h + 6) * STRIP * 4);
+        for (int s = s0; s < s1; s++) {
+            int x0 = s * STRIP, width = min(STRIP, w - x0) * 4;
+            float* x = &buf[3 * width];
+            for (int y = 0; y < h; y++) {
+                const unsigned char* in = img + ((size_t)y * w + x0) * 4;
+                for (int c = 0; c < width; c++) {
+                    x[(size_t)y * width + c] = in[c];
+                }
+            }
+
+            recurse(buf.data(), h, width, k);
+
+            for (int y = 0; y < h; y++) {
+                unsigned char* out = img + ((size_t)y * w + x0) * 4;
+                for (int c = 0; c < width; c++) {
+                    out[c] = to_byte(x[(size_t)y * width + c]);
+                }
+            }
+        }
+    }, 4);
+}
+
+// mean of every f x f block of src shifted right and down by pad pixels,
+// whatever falls outside the image is the nearest edge pixel
+static void downsample(const unsigned char* src, int stride, int ncomp, int w, int h, int f,
+        int pad, unsigned char* dst, int dw, int dh)
+{
+    parallel_rows(dh, [&](int y0, int y1) {
+        vector<unsigned> sum((size_t)dw * 4);
+        for (int y = y0; y < y1; y++) {
+            fill(sum.begin(), sum.end(), 0);
+            for (int sy = y * f - pad; sy < (y + 1) * f - pad; sy++) {
+                const unsigned char* in = src + (size_t)min(max(sy, 0), h - 1) * stride;
+                for (int x = 0; x < dw * f; x++) {
+                    const unsigned char* p = in + min(max(x - pad, 0), w - 1) * ncomp;
+                    unsigned* acc = &sum[(x / f) * 4];
+                    acc[0] += p[0];
+                    acc[1] += p[1];
+                    acc[2] += p[2];
+                    acc[3] += ncomp == 4 ? p[3] : 255;
+                }
+            }
+            unsigned char* out = dst + (size_t)y * dw * 4;
+            unsigned n = f * f;
+            for (int x = 0; x < dw * 4; x++) {
+                out[x] = (sum[x] + n / 2) / n;
+            }
+        }
+    });
+}
+
+// bilinear back to w x h, undoing the pad of downsample()
+static void upsample(const unsigned char* src, int sw, int sh, int f, int pad, int w, int h,
+        unsigned char* dst)
+{
+    vector<int> x0(w), x1(w);
+    vector<float> fx(w);
+    for (int x = 0; x < w; x++) {
+        float u = (x + pad + 0.5f) / f - 0.5f;
+        x0[x] = min((int)u, sw - 1);
+        x1[x] = min(x0[x] + 1, sw - 1);
+        fx[x] = u - (int)u;
+    }
+
+    parallel_rows(h, [&](int y0, int y1) {
+        for (int y = y0; y < y1; y++) {
+            float v = (y + pad + 0.5f) / f - 0.5f;
+            int r0 = min((int)v, sh - 1), r1 = min(r0 + 1, sh - 1);
+            float fy = v - (int)v;
+            const unsigned char* a = src + (size_t)r0 * sw * 4;
+            const unsigned char* b = src + (size_t)r1 * sw * 4;
+            unsigned char* out = dst + (size_t)y * w * 4;
+            for (int x = 0; x < w; x++) {
+                for (int c = 0; c < 4; c++) {
+                    float top = a[x0[x]*4+c] + (a[x1[x]*4+c] - a[x0[x]*4+c]) * fx[x];
+                    float bottom = b[x0[x]*4+c] + (b[x1[x]*4+c] - b[x0[x]*4+c]) * fx[x];
+                    out[x*4+c] = to_byte(top + (bottom - top) * fy);
+                }
+            }
+        }
+    });
+}
+
+/*
+ * the poles of the recursion move towards 1 as sigma grows and float
+ * rounding starts to show. past MAX_IIR_SIGMA the image is reduced by f
+ * first like the GPU path does, the recursion runs at sigma / f and the
+ * result is scaled back up; the box and the bilinear tent are taken out of
+ * the sigma as in equivalent_sigma(). the reduced image carries 3 sigma of
+ * edge pixels on every side, a block mean at the edge would otherwise stand
+ * in for the clamped edge and the corners would drift.
+ */
+#define MAX_IIR_SIGMA 16.0f
+
+void iir_gaussian_blur(const unsigned char* src, int stride, int w, int h, int ncomp,
+        float sigma, unsigned char* dst)
+{
+    sigma = fmaxf(sigma, 0.5f);
+    int f = max(1, (int)ceilf(sigma / MAX_IIR_SIGMA));
+    if (f == 1) {
+        iir_coefs k = find_coefs(sigma);
+        blur_rows(src, stride, ncomp, w, h, k, dst);
+        blur_columns(dst, w, h, k);
+        return;
+    }
+
+    float box = (f * f - 1.0f) / 12.0f, tent = f * f / 6.0f;
+    float reduced = sqrtf(fmaxf(sigma * sigma - box - tent, 0.25f * f * f)) / f;
+    iir_coefs k = find_coefs(reduced);
+
+    int pad = (int)ceilf(3.0f * reduced) * f;
+    int sw = (w + f - 1) / f + 2 * pad / f, sh = (h + f - 1) / f + 2 * pad / f;
+    vector<unsigned char> small((size_t)sw * sh * 4);
+    downsample(src, stride, ncomp, w, h, f, pad, small.data(), sw, sh);
+    blur_rows(small.data(), sw * 4, 4, sw, sh, k, small.data());
+    blur_columns(small.data(), sw, sh, k);
+    upsample(small.data(), sw, sh, f, pad, w, h, dst);
+}
+
+void reduce_image(const unsigned char* src, int stride, int ncomp, int w, int h, int f,
+        unsigned char* dst)
+{
+    downsample(src, stride, ncomp, w, h, f, 0, dst, (w + f - 1) / f, (h + f - 1) / f);
+}
@@ -0,0 +1,22 @@
+#ifndef IIR_BLUR_H
+#define IIR_BLUR_H
+
+/*
+ * recursive Gaussian for blurs far beyond the radius 49 kernels, run by
+ * blur_image -B cpu. a third order filter (Young and van Vliet) goes forward
+ * and backward along every row, then every column, so the cost per pixel is
+ * the same for any sigma. edges are clamped like GL_CLAMP_TO_EDGE, the right
+ * edge with the initial values of Triggs and Sdika.
+ */
+
+// src has rows of stride bytes with ncomp 3 or 4 components, dst is w x h
+// RGBA; sigma in pixels, at least 0.5
+void iir_gaussian_blur(const unsigned char* src, int stride, int w, int h, int ncomp,
+        float sigma, unsigned char* dst);
+
+// mean of f x f blocks of src into ceil(w / f) x ceil(h / f) RGBA, blocks at
+// the right and bottom edge are filled out with the edge pixels
+void reduce_image(const unsigned char* src, int stride, int ncomp, int w, int h, int f,
+        unsigned char* dst);
+
+#endif
@@ -1,6 +1,9 @@
 #include <iostream>
+#include <algorithm>
+#include <vector>
 #include <cassert>
 #include <cmath>
+#include <unistd.h>
 #define GLEW_STATIC
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -14,6 +17,8 @@ using namespace std;
     exit(-1); \
 } while (0)
 
+#define PYRAMID_LEVELS 6
+
 static struct context {
     GLFWwindow* window;
     int width, height;
@@ -25,6 +30,13 @@ static struct context {
     GLuint fbTex[2]; // texture attached to offscreen fb
     GLuint fb[2];
     float tex_width, tex_height;
+
+    // -a: blur pyramid of the source, level 0 at tex size, each next level
+    // half the size and blurred once more
+    GLuint programMix, programCopy;
+    GLuint pyrTex[PYRAMID_LEVELS], pyrFb[PYRAMID_LEVELS];
+    GLuint pyrTmpTex[PYRAMID_LEVELS], pyrTmpFb[PYRAMID_LEVELS]; // vertical pass at the size of the level above
+    int pyrWidth[PYRAMID_LEVELS], pyrHeight[PYRAMID_LEVELS];
 } ctx = {
     nullptr,
     0,
@@ -111,6 +123,37 @@ void main() {
 }
 )";
 
+// frames blend two neighbouring pyramid levels, texture units 0 and 1
+const GLchar* vs_mix = R"(
+#version 120
+
+varying vec3 fragColor;
+varying vec2 texCoord;
+
+uniform sampler2D lower;
+uniform sampler2D upper;
+uniform float t;
+
+void main() {
+    vec2 tc = vec2(texCoord.s, 1.0 - texCoord.t);
+    gl_FragColor = mix(texture2D(lower, tc), texture2D(upper, tc), t);
+}
+)";
+
+// unflipped copy of the source into pyramid level 0
+const GLchar* vs_copy = R"(
+#version 120
+
+varying vec3 fragColor;
+varying vec2 texCoord;
+
+uniform sampler2D sampler;
+
+void main() {
+    gl_FragColor = texture2D(sampler, texCoord);
+}
+)";
+
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
@@ -143,7 +186,14 @@ static GLuint build_program(int stage)
 
     GLuint ts = build_shader(ts_code, GL_VERTEX_SHADER);
     glAttachShader(program, ts);
-    GLuint vs = build_shader(stage == 1 ? vs_code : (stage == 2 ?vs_code_h : vs_direct), GL_FRAGMENT_SHADER);
+    const GLchar* code = vs_direct;
+    switch(stage) {
+        case 1: code = vs_code; break;
+        case 2: code = vs_code_h; break;
+        case 4: code = vs_mix; break;
+        case 5: code = vs_copy; break;
+    }
+    GLuint vs = build_shader(code, GL_FRAGMENT_SHADER);
     glAttachShader(program, vs);
 
     glLinkProgram(program);
@@ -178,6 +228,8 @@ static GLuint build_program(int stage)
 // must be odd
 static GLint radius = 3;
 static GLfloat kernel[41];
+// set when GPU timestamps feed the HUD, see collect_timers()
+static bool use_timer = false;
 
 static void build_gaussian_blur_kernel(GLint* pradius, GLfloat* offset, GLfloat* weight)
 {
@@ -193,7 +245,8 @@ static void build_gaussian_blur_kernel(GLint* pradius, GLfloat* offset, GLfloat*
     }
     sum -= (weight[radius+1] + weight[radius]) * 2.0;
 
-    cerr << "N = " << N << ", sum = " << sum << endl;
+    // once per frame, it would bury the HUD
+    if (!use_timer) cerr << "N = " << N << ", sum = " << sum << endl;
 
     GLfloat bias = 1.5;
     for (int i = 0; i < radius; i++) {
@@ -280,6 +333,8 @@ static void gl_init()
     ctx.program = build_program(1);
     ctx.programH = build_program(2);
     ctx.programDirect = build_program(3);
+    ctx.programMix = build_program(4);
+    ctx.programCopy = build_program(5);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
@@ -288,6 +343,127 @@ static void gl_init()
     kernel[0] = radius;
 }
 
+/*
+ * GPU timestamps around every pass, kept in a ring and read back
+ * QUERY_FRAMES frames later so collecting them never waits on the pipeline
+ * being measured. a frame whose slot is still in flight goes untimed.
+ */
+#define QUERY_FRAMES 4
+#define MAX_ROUNDS 4
+#define MAX_MARKS (2 * MAX_ROUNDS + 2) // start, after each pass, after output
+
+struct seq {
+    int rounds;
+    int radius;
+};
+
+struct frame_timer {
+    GLuint queries[MAX_MARKS];
+    int marks;
+    int seq; // seqs[] entry timed, -1 if the slot is free
+    double cpu; // ms spent submitting the frame
+};
+
+// per seqs[] entry, all in ms
+struct seq_stats {
+    double vertical, horizontal, output;
+    vector<double> gpu, cpu;
+};
+
+static frame_timer timers[QUERY_FRAMES];
+static frame_timer* cur_timer = NULL;
+static int timer_frame = 0, dropped_frames = 0;
+static vector<seq_stats> stats;
+
+static void timer_mark()
+{
+    if (cur_timer) {
+        glQueryCounter(cur_timer->queries[cur_timer->marks++], GL_TIMESTAMP);
+    }
+}
+
+// move finished slots into stats, without blocking
+static void collect_timers()
+{
+    for (auto& t: timers) {
+        if (t.seq < 0) continue;
+
+        GLint available = 0;
+        glGetQueryObjectiv(t.queries[t.marks-1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) continue;
+
+        GLuint64 ts[MAX_MARKS];
+        for (int i = 0; i < t.marks; i++) {
+            glGetQueryObjectui64v(t.queries[i], GL_QUERY_RESULT, &ts[i]);
+        }
+
+        // passes alternate vertical and horizontal, the output draw is last
+        seq_stats& st = stats[t.seq];
+        for (int i = 0; i + 1 < t.marks; i++) {
+            double ms = (ts[i+1] - ts[i]) / 1000000.0;
+            if (i + 2 == t.marks) st.output += ms;
+            else if (i % 2 == 0) st.vertical += ms;
+            else st.horizontal += ms;
+        }
+        st.gpu.push_back((ts[t.marks-1] - ts[0]) / 1000000.0);
+        st.cpu.push_back(t.cpu);
+        t.seq = -1;
+    }
+}
+
+static void begin_frame(int seq)
+{
+    cur_timer = NULL;
+    if (!use_timer) return;
+
+    collect_timers();
+    frame_timer& t = timers[timer_frame++ % QUERY_FRAMES];
+    if (t.seq >= 0) {
+        dropped_frames++;
+        return;
+    }
+    t.marks = 0;
+    t.seq = seq;
+    t.cpu = glfwGetTime();
+    cur_timer = &t;
+    timer_mark();
+}
+
+static void end_frame()
+{
+    if (cur_timer) {
+        cur_timer->cpu = (glfwGetTime() - cur_timer->cpu) * 1000.0;
+    }
+    cur_timer = NULL;
+}
+
+static double percentile(vector<double> v, double p)
+{
+    if (v.empty()) return 0.0;
+    sort(v.begin(), v.end());
+    return v[(size_t)(p * (v.size() - 1) + 0.5)];
+}
+
+// printed to stderr after every cycle through seqs[], totals since start
+static void print_hud(const seq* seqs, int n)
+{
+    vector<double> gpu, cpu;
+    fprintf(stderr, "%6s %6s %7s %9s %10s %8s %8s %8s\n", "rounds", "radius", "frames",
+            "vertical", "horizontal", "output", "gpu p50", "gpu p99");
+    for (int i = 0; i < n; i++) {
+        const seq_stats& st = stats[i];
+        int frames = st.gpu.size();
+        if (!frames) continue;
+        fprintf(stderr, "%6d %6d %7d %9.3f %10.3f %8.3f %8.3f %8.3f\n", seqs[i].rounds,
+                seqs[i].radius, frames, st.vertical / frames, st.horizontal / frames,
+                st.output / frames, percentile(st.gpu, 0.5), percentile(st.gpu, 0.99));
+        gpu.insert(gpu.end(), st.gpu.begin(), st.gpu.end());
+        cpu.insert(cpu.end(), st.cpu.begin(), st.cpu.end());
+    }
+    fprintf(stderr, "frame gpu p50 %.3f p90 %.3f p99 %.3f ms, cpu p50 %.3f p90 %.3f p99 %.3f ms, "
+            "%d untimed\n", percentile(gpu, 0.5), percentile(gpu, 0.9), percentile(gpu, 0.99),
+            percentile(cpu, 0.5), percentile(cpu, 0.9), percentile(cpu, 0.99), dropped_frames);
+}
 
 int rounds = 1;
 static void render()
@@ -321,7 +497,7 @@ static void render()
         glUniform2f(glGetUniformLocation(ctx.program, "resolution"),
                 (GLfloat)ctx.tex_width, (GLfloat)ctx.tex_height);
         glDrawArrays(GL_TRIANGLES, 0, 6);
-
+        timer_mark();
 
         glBindFramebuffer(GL_FRAMEBUFFER, ctx.fb[1]);
         glBindTexture(GL_TEXTURE_2D, ctx.fbTex[0]);
@@ -330,6 +506,7 @@ static void render()
         glUniform2f(glGetUniformLocation(ctx.programH, "resolution"),
                 (GLfloat)ctx.tex_width, (GLfloat)ctx.tex_height);
         glDrawArrays(GL_TRIANGLES, 0, 6);
+        timer_mark();
     }
 
     glViewport(0, 0, ctx.width, ctx.height);
@@ -337,12 +514,148 @@ static void render()
     glBindTexture(GL_TEXTURE_2D, ctx.fbTex[1]);
     glUseProgram(ctx.programDirect);
     glDrawArrays(GL_TRIANGLES, 0, 6);
+    timer_mark();
 
     glfwSwapBuffers(ctx.window);
 }
 
+static void create_target(GLuint* tex, GLuint* fb, int w, int h)
+{
+    glGenTextures(1, tex);
+    glBindTexture(GL_TEXTURE_2D, *tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, fb);
+    glBindFramebuffer(GL_FRAMEBUFFER, *fb);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, *tex, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        err_quit("framebuffer create failed\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// runs once per source image. every level blurs the one above with a small
+// kernel and halves it in the horizontal pass, so the blur in source texels
+// roughly doubles from level to level
+static void build_pyramid()
+{
+    GLint r = 3;
+    build_gaussian_blur_kernel(&r, &kernel[1], &kernel[21]);
+    kernel[0] = r;
+
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+    glDisable(GL_DEPTH_TEST);
+
+    for (int i = 0; i < PYRAMID_LEVELS; i++) {
+        ctx.pyrWidth[i] = max(1, (int)ctx.tex_width >> i);
+        ctx.pyrHeight[i] = max(1, (int)ctx.tex_height >> i);
+        create_target(&ctx.pyrTex[i], &ctx.pyrFb[i], ctx.pyrWidth[i], ctx.pyrHeight[i]);
+        if (i > 0) {
+            create_target(&ctx.pyrTmpTex[i], &ctx.pyrTmpFb[i], ctx.pyrWidth[i-1],
+                    ctx.pyrHeight[i-1]);
+        }
+    }
+
+    glViewport(0, 0, ctx.pyrWidth[0], ctx.pyrHeight[0]);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx.pyrFb[0]);
+    glBindTexture(GL_TEXTURE_2D, ctx.tex);
+    glUseProgram(ctx.programCopy);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+
+    for (int i = 1; i < PYRAMID_LEVELS; i++) {
+        // texel steps of the level above for both passes
+        int w = ctx.pyrWidth[i-1], h = ctx.pyrHeight[i-1];
+
+        glViewport(0, 0, w, h);
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.pyrTmpFb[i]);
+        glBindTexture(GL_TEXTURE_2D, ctx.pyrTex[i-1]);
+        glUseProgram(ctx.program);
+        glUniform1fv(glGetUniformLocation(ctx.program, "kernel"), 41, kernel);
+        glUniform2f(glGetUniformLocation(ctx.program, "resolution"), (GLfloat)w, (GLfloat)h);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+
+        glViewport(0, 0, ctx.pyrWidth[i], ctx.pyrHeight[i]);
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx.pyrFb[i]);
+        glBindTexture(GL_TEXTURE_2D, ctx.pyrTmpTex[i]);
+        glUseProgram(ctx.programH);
+        glUniform1fv(glGetUniformLocation(ctx.programH, "kernel"), 41, kernel);
+        glUniform2f(glGetUniformLocation(ctx.programH, "resolution"), (GLfloat)w, (GLfloat)h);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// one draw for any strength in [0, PYRAMID_LEVELS - 1], the cost does not
+// depend on it
+static void render_animation(float strength)
+{
+    int lower = min((int)strength, PYRAMID_LEVELS - 2);
+
+    glBindBuffer(GL_ARRAY_BUFFER, ctx.vbo);
+    glDisable(GL_DEPTH_TEST);
+    glViewport(0, 0, ctx.width, ctx.height);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glUseProgram(ctx.programMix);
+    glUniform1i(glGetUniformLocation(ctx.programMix, "lower"), 0);
+    glUniform1i(glGetUniformLocation(ctx.programMix, "upper"), 1);
+    glUniform1f(glGetUniformLocation(ctx.programMix, "t"), strength - lower);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, ctx.pyrTex[lower + 1]);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, ctx.pyrTex[lower]);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    timer_mark();
+
+    glfwSwapBuffers(ctx.window);
+}
+
+// rows are the lower pyramid level a frame blended from
+static void print_animation_hud(double build_ms)
+{
+    vector<double> gpu, cpu;
+    fprintf(stderr, "pyramid build %.3f ms\n%6s %7s %8s %8s %8s\n", build_ms, "level",
+            "frames", "draw", "gpu p50", "gpu p99");
+    for (int i = 0; i < PYRAMID_LEVELS - 1; i++) {
+        const seq_stats& st = stats[i];
+        int frames = st.gpu.size();
+        if (!frames) continue;
+        fprintf(stderr, "%6d %7d %8.3f %8.3f %8.3f\n", i, frames, st.output / frames,
+                percentile(st.gpu, 0.5), percentile(st.gpu, 0.99));
+        gpu.insert(gpu.end(), st.gpu.begin(), st.gpu.end());
+        cpu.insert(cpu.end(), st.cpu.begin(), st.cpu.end());
+    }
+    fprintf(stderr, "frame gpu p50 %.3f p90 %.3f p99 %.3f ms, cpu p50 %.3f p90 %.3f p99 %.3f ms, "
+            "%d untimed\n", percentile(gpu, 0.5), percentile(gpu, 0.9), percentile(gpu, 0.99),
+            percentile(cpu, 0.5), percentile(cpu, 0.9), percentile(cpu, 0.99), dropped_frames);
+}
+
+static void usage()
+{
+    err_quit("usage: blur-exp [-a]\n"
+            "\t[-a] animate blur in and out from a pyramid built once\n"
+            "texture.jpg in the current directory is the source\n");
+}
+
 int main(int argc, char *argv[])
 {
+    bool animate = false;
+    int ch;
+    while ((ch = getopt(argc, argv, "ah")) != -1) {
+        switch(ch) {
+            case 'a': animate = true; break;
+            case 'h':
+            default: usage(); break;
+        }
+    }
+
     if (!glfwInit()) {
         err_quit("glfwInit failed\n");
     }
@@ -381,41 +694,20 @@ int main(int argc, char *argv[])
 
     if (GLEW_ARB_timer_query) {
         cerr << "ARB_timer_query exists\n";
+        use_timer = true;
+        for (auto& t: timers) {
+            glGenQueries(MAX_MARKS, t.queries);
+            t.seq = -1;
+        }
     }
     glfwSwapInterval(1);
 
-    GLuint query;
-    GLint available = 0;
-    GLuint64 timeElapsed = 0; // nanoseconds
-
-    if (GLEW_ARB_timer_query) {
-        glGenQueries(1, &query);
-    }
-
-#define query_timer() do { \
-    if (GLEW_ARB_timer_query) glBeginQuery(GL_TIME_ELAPSED, query); \
-} while (0)
-
-#define end_timer() do { \
-        if (GLEW_ARB_timer_query) {     \
-            glEndQuery(GL_TIME_ELAPSED);    \
-            while (!available) {    \
-                glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);   \
-            }   \
-    \
-            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &timeElapsed);    \
-            cerr << "cost = " << (GLdouble)timeElapsed / 1000000.0 << endl;     \
-        }   \
-} while (0)
-
     gl_init();
 
     glfwShowWindow(ctx.window);
 
-    struct seq {
-        int rounds;
-        int radius;
-    } seqs[] = {
+    // rounds must not exceed MAX_ROUNDS
+    seq seqs[] = {
         {1, 1},
         {2, 1},
         {3, 1},
@@ -443,11 +735,42 @@ int main(int argc, char *argv[])
     };
 
     int N = sizeof(seqs)/sizeof(seqs[0]);
+    stats.resize(max(N, PYRAMID_LEVELS - 1));
     int i = 0;
     auto time = glfwGetTime();
     float animationDuration = 4.0;
+
+    if (animate) {
+        // the build is timed once with a blocking finish, frames are not
+        double build_ms = glfwGetTime();
+        build_pyramid();
+        glFinish();
+        build_ms = (glfwGetTime() - build_ms) * 1000.0;
+        cerr << "pyramid of " << PYRAMID_LEVELS << " levels built in " << build_ms << " ms" << endl;
+
+        // blur in and out, one full cycle per animationDuration
+        double start = glfwGetTime(), last_hud = start;
+        while (!glfwWindowShouldClose(ctx.window)) {
+            double phase = fmod((glfwGetTime() - start) / animationDuration, 1.0);
+            float strength = (PYRAMID_LEVELS - 1) * (1.0f - fabsf(2.0f * (float)phase - 1.0f));
+
+            begin_frame(min((int)strength, PYRAMID_LEVELS - 2));
+            render_animation(strength);
+            end_frame();
+            glfwPollEvents();
+
+            if (use_timer && glfwGetTime() - last_hud >= animationDuration) {
+                print_animation_hud(build_ms);
+                last_hud = glfwGetTime();
+            }
+        }
+
+        glfwTerminate();
+        return 0;
+    }
+
     while (!glfwWindowShouldClose(ctx.window)) {
-        query_timer();
+        begin_frame(i);
 
         radius = seqs[i].radius;
         build_gaussian_blur_kernel(&radius, &kernel[1], &kernel[21]);
@@ -456,7 +779,7 @@ int main(int argc, char *argv[])
         rounds = seqs[i].rounds;
         render();
 
-        end_timer();
+        end_frame();
         //while (glfwGetTime() - time < 1.0/2.0) {
             //glfwWaitEvents();
         //}
@@ -466,6 +789,9 @@ int main(int argc, char *argv[])
         }
         i = (i + 1) % N;
         time = glfwGetTime();
+        if (i == 0 && use_timer) {
+            print_hud(seqs, N);
+        }
     }
 
     glfwTerminate();
@@ -0,0 +1,43 @@
+#!/bin/sh
+# compare decode/encode cost of the jpeg, png and uncompressed paths
+# usage: bench_formats.sh image [runs] [blur_image options...]
+# needs ImageMagick convert to produce the inputs, results are the average
+# per stage as printed by blur_image -T
+
+img=$1
+runs=${2:-5}
+[ -n "$img" ] || { echo "usage: $0 image [runs] [blur_image options...]"; exit 1; }
+shift; [ $# -gt 0 ] && shift
+blur=${BLUR_IMAGE:-./blur_image}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for fmt in jpg png ppm pam; do
+    convert "$img" "$dir/in.$fmt" || exit 1
+done
+
+# raw: 16 byte BLRW header (little endian width, height, ncomp) + RGBA rows
+w=$(identify -format %w "$img")
+h=$(identify -format %h "$img")
+le32() { printf "\\$(printf %o $(($1 & 255)))\\$(printf %o $(($1 >> 8 & 255)))\\$(printf %o $(($1 >> 16 & 255)))\\$(printf %o $(($1 >> 24 & 255)))"; }
+{
+    printf BLRW; le32 $w; le32 $h; printf '\004\000\000\000'
+    convert "$img" -depth 8 rgba:-
+} > "$dir/in.raw"
+
+for fmt in jpg png ppm pam raw; do
+    for i in $(seq $runs); do
+        "$blur" -T "$@" "$dir/in.$fmt" -o "$dir/out.$fmt" 2>&1 >/dev/null | tail -n 1
+    done | awk -v fmt=$fmt -v size=$(stat -c %s "$dir/in.$fmt") '
+        {
+            for (i = 1; i <= NF; i++) if ($(i+1) ~ /^[0-9.]+$/ && $(i+2) ~ /^ms/) {
+                t[$i] += $(i+1); if (!(($i) in seen)) { seen[$i] = 1; order[n++] = $i }
+            }
+            runs++
+        }
+        END {
+            printf "%-4s %9d bytes:", fmt, size
+            for (i = 0; i < n; i++) printf " %s %.2f", order[i], t[order[i]] / runs
+            printf " ms\n"
+        }'
+done